@@ -9,24 +9,153 @@
 #ifndef __MOCHI_PLUMBER
 #define __MOCHI_PLUMBER
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* buffer size that is sufficient to hold any resolved address produced by
+ * mochi_plumber_resolve_nic_buf() on known systems
+ */
+#define MOCHI_PLUMBER_ADDR_MAX 256
+
 /**
  * @brief Resolve the general network address (e.g., cxi://) to a
  * specific network card (e.g., cxi://cxi0).
  *
+ * NICs are selected for the "ofi+cxi" (or "cxi") protocol, and for the first
+ * available of "ofi+cxi", "ofi+verbs", and "ofi+tcp" when the protocol is
+ * "auto" or a list separated by '|'; other addresses are passed through.
+ * The bucket policy ("all", "numa", "package", "measured", "passthrough", an
+ * hwloc object type such as "l3", or "depth:<n>", optionally followed by
+ * "+overlap") divides the NICs into buckets and chooses the one that serves
+ * the caller.  The NIC policy ("roundrobin", "random", "bycore", "byset",
+ * "irq", or "passthrough") chooses a NIC within that bucket.  See README.md
+ * for the policies and for the environment variables that affect resolution
+ * (broker, job partitioning, memoization, and tracing).
+ *
  * @param [in] in_address input address string
  * @param [in] bucket_policy policy for bucket selection
  * @param [in] nic_policy policy for nic selection within bucket
  * @param [out] out_address output address string (to be freed by caller)
+ * @returns 0 on success, -1 on failure
  */
 int mochi_plumber_resolve_nic(const char* in_address,
                               const char* bucket_policy,
                               const char* nic_policy,
                               char**      out_address);
 
+/**
+ * @brief Same as mochi_plumber_resolve_nic(), but writes the resolved
+ * address into a caller-provided buffer.  The topology and bucket table for
+ * each bucket policy are built on first use and retained, so subsequent
+ * calls do not allocate heap memory.
+ *
+ * @param [in] in_address input address string
+ * @param [in] bucket_policy policy for bucket selection
+ * @param [in] nic_policy policy for nic selection within bucket
+ * @param [out] out_address buffer to hold the output address string
+ * @param [in] out_size size of out_address in bytes
+ * @returns 0 on success, -1 on failure, or the required buffer size if
+ * out_size is too small to hold the output address
+ */
+int mochi_plumber_resolve_nic_buf(const char* in_address,
+                                  const char* bucket_policy,
+                                  const char* nic_policy,
+                                  char*       out_address,
+                                  size_t      out_size);
+
+/**
+ * @brief Select a NIC for a transfer to or from a memory region according
+ * to where the region is placed, rather than where the caller is running.
+ * This is meant to be called per transfer on multi-rail systems.
+ *
+ * The bucket is the one nearest the NUMA domain holding the first page of
+ * the region (or its last page, if the first one has not been touched yet),
+ * or the one serving the calling thread's PU if neither has been touched.
+ * Within the bucket, regions are spread across the NICs by their
+ * 2 MiB-aligned address, so a given buffer always maps to the same NIC.
+ * Neither the broker nor the results of earlier resolutions are consulted.
+ * Only the first call for an address and bucket policy takes a lock or
+ * allocates; later calls make at most one system call (move_pages()).
+ *
+ * @param [in] in_address input address string
+ * @param [in] bucket_policy policy for bucket selection
+ * @param [in] region start of the memory region
+ * @param [in] region_len length of the memory region in bytes
+ * @param [out] out_address buffer to hold the output address string
+ * @param [in] out_size size of out_address in bytes
+ * @returns 0 on success, -1 on failure, or the required buffer size if
+ * out_size is too small to hold the output address
+ */
+int mochi_plumber_resolve_nic_for_region(const char* in_address,
+                                         const char* bucket_policy,
+                                         const void* region,
+                                         size_t      region_len,
+                                         char*       out_address,
+                                         size_t      out_size);
+
+/* handle for a running mochi_plumber_watch_start() */
+typedef struct mochi_plumber_watch* mochi_plumber_watch_t;
+
+/* called with the newly recommended address when it changes */
+typedef void (*mochi_plumber_watch_fn)(const char* address, void* arg);
+
+/**
+ * @brief Watch for NICs being added, removed, reset, or disabled, and call
+ * cb with a new address for in_address when the recommendation changes, so
+ * that long-running services can move their endpoints without restarting.
+ *
+ * A background thread rescans the local NICs whenever the kernel reports
+ * a network, InfiniBand, or PCI device event, and otherwise every
+ * MOCHI_PLUMBER_WATCH_INTERVAL seconds (10 by default).  If the set of
+ * NICs or the state of their links has changed, the NIC last reported is
+ * kept while it is present and its link is not down.  Otherwise the cached
+ * topology, bucket tables, and earlier results are discarded for the whole
+ * process, and in_address is resolved again as usual (by the broker, if
+ * there is one) from a thread with the same CPU binding as the one that
+ * started the watch.  cb is called from the watch thread, and only if the
+ * result differs from the last address reported (initially the address
+ * mochi_plumber_resolve_nic() returns to the calling thread).
+ *
+ * @param [in] in_address input address string
+ * @param [in] bucket_policy policy for bucket selection
+ * @param [in] nic_policy policy for nic selection within bucket
+ * @param [in] cb function to call with the new address
+ * @param [in] arg argument passed to cb
+ * @param [out] watch handle to pass to mochi_plumber_watch_stop()
+ * @returns 0 on success, -1 on failure
+ */
+int mochi_plumber_watch_start(const char*            in_address,
+                              const char*            bucket_policy,
+                              const char*            nic_policy,
+                              mochi_plumber_watch_fn cb,
+                              void*                  arg,
+                              mochi_plumber_watch_t* watch);
+
+/**
+ * @brief Stop a watch and wait for its thread to exit.  cb will not be
+ * called once this returns.
+ *
+ * @param [in] watch handle from mochi_plumber_watch_start()
+ */
+void mochi_plumber_watch_stop(mochi_plumber_watch_t watch);
+
+/**
+ * @brief Measure the affinity of each NIC to each NUMA domain by timing
+ * loopback messages through the NIC from a thread bound to each domain, and
+ * record the results in an affinity table for use by the "measured" bucket
+ * policy.
+ *
+ * @param [in] prov_name libfabric provider to probe (e.g., "cxi" or "tcp")
+ * @param [in] affinity_file path of the table to write, or NULL for the
+ * default location (the MOCHI_PLUMBER_AFFINITY_FILE environment variable
+ * if set, otherwise /tmp/<login>-mochi-plumber/affinity)
+ * @returns 0 on success, -1 on failure
+ */
+int mochi_plumber_probe(const char* prov_name, const char* affinity_file);
+
 #ifdef __cplusplus
 }
 #endif
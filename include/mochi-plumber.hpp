@@ -0,0 +1,115 @@
+/**
+ * @file mochi-plumber.hpp
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#ifndef __MOCHI_PLUMBER_HPP
+#define __MOCHI_PLUMBER_HPP
+
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <mochi-plumber.h>
+
+namespace mochi {
+namespace plumber {
+
+/**
+ * @brief Resolved address string allocated by mochi_plumber_resolve_nic()
+ * and released when the object goes out of scope.
+ */
+class address {
+  public:
+    address() = default;
+    explicit address(char* str) noexcept : m_str(str) {}
+
+    std::string_view view() const noexcept {
+        return m_str ? std::string_view(m_str.get()) : std::string_view();
+    }
+    const char* c_str() const noexcept { return m_str ? m_str.get() : ""; }
+    operator std::string_view() const noexcept { return view(); }
+
+  private:
+    struct deleter {
+        void operator()(char* str) const noexcept { std::free(str); }
+    };
+    std::unique_ptr<char, deleter> m_str;
+};
+
+/**
+ * @brief Resolve a general network address to a specific network card.
+ * See mochi_plumber_resolve_nic() for the supported policies.
+ *
+ * @throws std::runtime_error if resolution fails
+ */
+inline address resolve_nic(const char* in_address,
+                           const char* bucket_policy,
+                           const char* nic_policy) {
+    char* out = nullptr;
+    if (mochi_plumber_resolve_nic(in_address, bucket_policy, nic_policy, &out)
+        != 0)
+        throw std::runtime_error(std::string("failed to resolve NIC for ")
+                                 + in_address);
+    return address(out);
+}
+
+/**
+ * @brief Resolves addresses into an internal fixed-size buffer so that
+ * warm resolutions do not allocate.  Each call overwrites the result of
+ * the previous one.
+ */
+class resolver {
+  public:
+    /**
+     * @brief Resolve a general network address to a specific network card.
+     *
+     * @returns view of the resolved address, valid until the next call or
+     * until the resolver is destroyed
+     * @throws std::runtime_error if resolution fails
+     */
+    std::string_view resolve(const char* in_address,
+                             const char* bucket_policy,
+                             const char* nic_policy) {
+        int ret = mochi_plumber_resolve_nic_buf(
+            in_address, bucket_policy, nic_policy, m_buf, sizeof(m_buf));
+        if (ret != 0)
+            throw std::runtime_error(std::string("failed to resolve NIC for ")
+                                     + in_address);
+        return std::string_view(m_buf);
+    }
+
+    /**
+     * @brief Select a NIC for a transfer from the memory region at
+     * region.  See mochi_plumber_resolve_nic_for_region().
+     *
+     * @returns view of the resolved address, valid until the next call or
+     * until the resolver is destroyed
+     * @throws std::runtime_error if resolution fails
+     */
+    std::string_view resolve_for_region(const char* in_address,
+                                        const char* bucket_policy,
+                                        const void* region,
+                                        std::size_t region_len) {
+        int ret = mochi_plumber_resolve_nic_for_region(
+            in_address, bucket_policy, region, region_len, m_buf,
+            sizeof(m_buf));
+        if (ret != 0)
+            throw std::runtime_error(std::string("failed to resolve NIC for ")
+                                     + in_address);
+        return std::string_view(m_buf);
+    }
+
+  private:
+    char m_buf[MOCHI_PLUMBER_ADDR_MAX] = {0};
+};
+
+} // namespace plumber
+} // namespace mochi
+
+#endif /* __MOCHI_PLUMBER_HPP */
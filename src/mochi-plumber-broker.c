@@ -0,0 +1,153 @@
+/**
+ * @file mochi-plumber-broker.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber-internal.h"
+
+/* seconds to wait before trying to reach a broker again after failing to */
+#define BROKER_RETRY 10
+
+/* The connection to the broker is kept open for the life of the process;
+ * the broker releases our NIC assignments when it is closed.  Callers of
+ * mochi_plumber_broker_resolve() serialize access to these.
+ */
+static int    broker_fd    = -1;
+static pid_t  broker_pid   = -1;
+static time_t broker_retry = 0; /* no connection attempts until then */
+
+static int  broker_connect(void);
+static void broker_disconnect(void);
+
+void mochi_plumber_broker_path(char* path, size_t size)
+{
+    const char* env = getenv("MOCHI_PLUMBER_BROKER_SOCKET");
+
+    if (env)
+        snprintf(path, size, "%s", env);
+    else {
+        mochi_plumber_user_dir(path, size);
+        snprintf(path + strlen(path), size - strlen(path), "/broker.sock");
+    }
+}
+
+int mochi_plumber_broker_resolve(const char* transport_name,
+                                 const char* bucket_policy,
+                                 const char* nic_policy,
+                                 const char* cpus,
+                                 const char* mems,
+                                 char*       out_nic,
+                                 size_t      out_size)
+{
+    char    request[4096];
+    char    response[MOCHI_PLUMBER_NIC_MAX + 16];
+    size_t  len = 0;
+    ssize_t ret;
+    int     cpu;
+
+    /* a child process must not share its parent's assignments */
+    if (broker_fd >= 0 && broker_pid != getpid()) broker_disconnect();
+    if (broker_fd < 0 && broker_connect() < 0) return (-1);
+
+    /* tell the broker where we are running, since it can't observe that */
+    cpu = sched_getcpu();
+    if (cpu < 0) return (-1);
+    if (cpus)
+        len = snprintf(request, sizeof(request), "resolve %s %s %s %d %s",
+                       transport_name, bucket_policy, nic_policy, cpu, cpus);
+    else
+        len = snprintf(request, sizeof(request), "resolve %s %s %s %d %d",
+                       transport_name, bucket_policy, nic_policy, cpu, cpu);
+    if (len < sizeof(request))
+        len += snprintf(request + len, sizeof(request) - len, "%s%s\n",
+                        mems ? " " : "", mems ? mems : "");
+    if (len >= sizeof(request)) return (-1);
+
+    if (send(broker_fd, request, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        broker_disconnect();
+        return (-1);
+    }
+
+    /* read a single line response */
+    len = 0;
+    while (len == 0 || response[len - 1] != '\n') {
+        if (len == sizeof(response) - 1) {
+            broker_disconnect();
+            return (-1);
+        }
+        ret = recv(broker_fd, response + len, sizeof(response) - 1 - len, 0);
+        if (ret <= 0) {
+            broker_disconnect();
+            return (-1);
+        }
+        len += ret;
+    }
+    response[len - 1] = '\0';
+
+    /* "ok <nic>", or just "ok" if the address should be passed through */
+    if (strcmp(response, "ok") == 0) {
+        snprintf(out_nic, out_size, "%s", "");
+        return (0);
+    }
+    if (strncmp(response, "ok ", 3) == 0) {
+        snprintf(out_nic, out_size, "%s", response + 3);
+        return (0);
+    }
+
+    return (-1);
+}
+
+static int broker_connect(void)
+{
+    struct sockaddr_un addr;
+    struct timeval     timeout = {.tv_sec = 1, .tv_usec = 0};
+    struct timespec    now;
+
+    /* most processes never have a broker, so don't try on every call */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < broker_retry) return (-1);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    mochi_plumber_broker_path(addr.sun_path, sizeof(addr.sun_path));
+
+    broker_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (broker_fd < 0
+        || connect(broker_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (broker_fd >= 0) close(broker_fd);
+        broker_fd    = -1;
+        broker_retry = now.tv_sec + BROKER_RETRY;
+        return (-1);
+    }
+
+    /* fall back to in-process resolution rather than hang on a stuck
+     * broker
+     */
+    setsockopt(broker_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(broker_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    broker_pid = getpid();
+
+    return (0);
+}
+
+static void broker_disconnect(void)
+{
+    if (broker_fd >= 0) close(broker_fd);
+    broker_fd = -1;
+}
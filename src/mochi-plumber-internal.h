@@ -0,0 +1,219 @@
+/**
+ * @file mochi-plumber-internal.h
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#ifndef __MOCHI_PLUMBER_INTERNAL
+#define __MOCHI_PLUMBER_INTERNAL
+
+#include <stddef.h>
+#include <stdio.h>
+#include <hwloc.h>
+
+/* longest NIC name that is exchanged between processes */
+#define MOCHI_PLUMBER_NIC_MAX 64
+
+/* one row of a NIC affinity table: the mean round trip latency (in
+ * nanoseconds) measured through a NIC from a thread bound to a NUMA domain
+ */
+struct mochi_plumber_affinity {
+    char   nic[MOCHI_PLUMBER_NIC_MAX];
+    int    numa; /* NUMA node OS index */
+    double latency;
+};
+
+/* the calling user's private directory for token files, the broker socket,
+ * and the affinity table: /tmp/<login>-mochi-plumber
+ */
+void mochi_plumber_user_dir(char* path, size_t size);
+
+/* path of the affinity table consulted by the "measured" bucket policy */
+void mochi_plumber_affinity_path(char* path, size_t size);
+
+/* read an affinity table; entries must be freed by the caller */
+int mochi_plumber_affinity_read(const char*                     path,
+                                int*                            num_entries,
+                                struct mochi_plumber_affinity** entries);
+
+/* chooses among the NICs of a bucket for the roundrobin and random policies;
+ * returns an index into nics, or -1 on failure
+ */
+typedef int (*mochi_plumber_pick_fn)(void*       arg,
+                                     const char* nic_policy,
+                                     int         num_nics,
+                                     char**      nics);
+
+/* Select a NIC on behalf of a process that last ran on last_cpu and is bound
+ * to cpuset, rather than the calling thread.  membind is the process's memory
+ * binding, or NULL if it is not bound.  transport_name is a Mercury
+ * protocol such as "ofi+cxi".  out_nic is set to an empty string if the
+ * address should be passed through.  If pick is not NULL it replaces the
+ * token files used to coordinate the roundrobin policy.
+ */
+int mochi_plumber_select_nic_at(const char*           transport_name,
+                                const char*           bucket_policy,
+                                const char*           nic_policy,
+                                hwloc_const_cpuset_t  last_cpu,
+                                hwloc_const_cpuset_t  cpuset,
+                                hwloc_const_nodeset_t membind,
+                                mochi_plumber_pick_fn pick,
+                                void*                 pick_arg,
+                                char*                 out_nic,
+                                size_t                out_size);
+
+/* Find the PUs local to a PCI device according to /sys, for devices that
+ * hwloc has no object for (e.g., when /sys is partially masked in a
+ * container).  Only PUs that the process may use are included.  Returns -1
+ * if the locality can't be determined.
+ */
+int mochi_plumber_pci_cpuset(hwloc_topology_t topology,
+                             unsigned int     domain_id,
+                             unsigned int     bus_id,
+                             unsigned int     device_id,
+                             unsigned int     function_id,
+                             hwloc_bitmap_t   cpuset);
+
+/* Find the CPUs that the interrupts of a PCI device are delivered to,
+ * according to /sys and /proc.  Returns -1 if they can't be determined.
+ */
+int mochi_plumber_irq_cpuset(unsigned int   domain_id,
+                             unsigned int   bus_id,
+                             unsigned int   device_id,
+                             unsigned int   function_id,
+                             hwloc_bitmap_t cpuset);
+
+/* The same, but with one cpuset per interrupt vector, in a newly allocated
+ * array to be released with mochi_plumber_irq_vectors_free().  Returns the
+ * number of vectors, or -1 if none could be read.
+ */
+int  mochi_plumber_irq_vectors(unsigned int     domain_id,
+                               unsigned int     bus_id,
+                               unsigned int     device_id,
+                               unsigned int     function_id,
+                               hwloc_bitmap_t** vectors);
+void mochi_plumber_irq_vectors_free(hwloc_bitmap_t* vectors, int num);
+
+/* Whether the link of a PCI device is up: 1 if any of its network
+ * interfaces or InfiniBand ports is up, 0 if none is, or -1 if the device
+ * has none that report a state.
+ */
+int mochi_plumber_link_state(unsigned int domain_id,
+                             unsigned int bus_id,
+                             unsigned int device_id,
+                             unsigned int function_id);
+
+/* path of the Unix domain socket that the broker daemon listens on */
+void mochi_plumber_broker_path(char* path, size_t size);
+
+/* Ask the node-local broker to select a NIC for the calling thread.  The
+ * process is bound to the PUs in cpus, or NULL if that isn't needed for
+ * the policies (the thread's current PU is sent instead), and its memory
+ * to the NUMA nodes in mems, or NULL if it is not bound; both are lists
+ * such as "0,2".  Returns -1 if no broker is reachable, in which case the
+ * caller should resolve in-process.  out_nic is set to an empty string for
+ * passthrough.
+ */
+int mochi_plumber_broker_resolve(const char* transport_name,
+                                 const char* bucket_policy,
+                                 const char* nic_policy,
+                                 const char* cpus,
+                                 const char* mems,
+                                 char*       out_nic,
+                                 size_t      out_size);
+
+/* Same as mochi_plumber_resolve_nic_buf(), but also reports the selected
+ * NIC in out_nic (an empty string for passthrough) if it is not NULL.
+ */
+int mochi_plumber_resolve_nic_named(const char* in_address,
+                                    const char* bucket_policy,
+                                    const char* nic_policy,
+                                    char*       out_address,
+                                    size_t      out_size,
+                                    char*       out_nic,
+                                    size_t      nic_size);
+
+/* Drop the cached topology, bucket tables, transport availability, and
+ * earlier results, so that the next resolution sees the current hardware.
+ */
+void mochi_plumber_invalidate(void);
+
+/* Describe the local NICs of every known transport (names, PCI addresses,
+ * and link states), so that a change in the set of NICs or in their links
+ * can be detected by comparing descriptions.  Each NIC is described as
+ * "<provider>:<name>@<PCI address>=<up, down, or ?>;".  Returns a string to
+ * be freed by the caller, or NULL on failure.
+ */
+char* mochi_plumber_nic_fingerprint(void);
+
+/* ID of the batch job the calling process belongs to, or NULL if it is not
+ * running under a known scheduler
+ */
+const char* mochi_plumber_job_id(void);
+
+/* Find the share of a bucket's num_nics NICs that belongs to the calling
+ * process's job, which is bound to cpuset: NICs [*first, *first + *count).
+ * Co-located jobs get disjoint (if there are enough NICs), contiguous
+ * shares in proportion to the PUs they hold in the bucket.  The calling
+ * process is registered with the node-wide job registry on first use.
+ * Returns -1 if there is no job or the registry is unavailable.
+ */
+int mochi_plumber_job_partition(hwloc_const_cpuset_t bucket_cpuset,
+                                hwloc_const_cpuset_t cpuset,
+                                int                  num_nics,
+                                int*                 first,
+                                int*                 count);
+
+/* Modification time (in ns) of the job registry, which changes whenever a
+ * process registers, or 0 if there is no registry.  Shares computed from an
+ * older registry may be out of date.
+ */
+long long mochi_plumber_job_stamp(void);
+
+/* phases of a resolution that are timed separately in the trace */
+enum mochi_plumber_trace_phase {
+    MOCHI_PLUMBER_TRACE_PREPARE,
+    MOCHI_PLUMBER_TRACE_MEMO,
+    MOCHI_PLUMBER_TRACE_BROKER,
+    MOCHI_PLUMBER_TRACE_TOPOLOGY,
+    MOCHI_PLUMBER_TRACE_TABLE,
+    MOCHI_PLUMBER_TRACE_SELECT,
+    MOCHI_PLUMBER_TRACE_PHASES
+};
+extern const char* const mochi_plumber_trace_phases[MOCHI_PLUMBER_TRACE_PHASES];
+
+/* Record of how one address was resolved.  Strings that are not known
+ * (e.g., the bucket of an address that was passed through) are NULL.
+ */
+struct mochi_plumber_trace {
+    const char* in_address;
+    const char* bucket_policy;
+    const char* nic_policy;
+    const char* address;     /* result */
+    const char* nic;         /* selected NIC */
+    const char* source;      /* "memo", "broker", or "local" */
+    const char* passthrough; /* why the address was not resolved */
+    int         status;
+    int         bucket;      /* -1 if not known */
+    int         num_nics;    /* NICs of the bucket that were drawn from */
+    char**      nics;
+    long        phase_ns[MOCHI_PLUMBER_TRACE_PHASES];
+};
+
+/* whether MOCHI_PLUMBER_TRACE names a directory to trace resolutions into */
+int mochi_plumber_trace_enabled(void);
+
+/* monotonic clock in nanoseconds, for timing trace phases */
+long mochi_plumber_trace_clock(void);
+
+/* Append a record to this process's trace file as a line of JSON, along
+ * with the CPU and CPU set of the calling thread.
+ */
+void mochi_plumber_trace_write(const struct mochi_plumber_trace* trace);
+
+/* print a string as a JSON string (or null if str is NULL) */
+void mochi_plumber_json_string(FILE* f, const char* str);
+
+#endif /* __MOCHI_PLUMBER_INTERNAL */
@@ -0,0 +1,238 @@
+/**
+ * @file mochi-plumber-job.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <hwloc.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber-internal.h"
+
+/* Node-wide registry of the jobs using mochi-plumber.  It is shared by all
+ * users, so that co-located jobs of different users can see each other.
+ * Each job has a file named after its job ID holding one "<pid> <cpus>"
+ * line per registered process.  Lines of processes that have exited, or
+ * that belong to a different user than the file, are ignored, so a user can
+ * only claim PUs on behalf of processes of their own.  The PUs themselves
+ * are taken on trust.
+ */
+#define JOB_REGISTRY "/tmp/mochi-plumber-jobs"
+
+/* environment variables that batch schedulers put the job ID in */
+static const char* job_id_vars[]
+    = {"SLURM_JOB_ID", "PBS_JOBID", "LSB_JOBID", "FLUX_JOB_ID", "COBALT_JOBID"};
+
+/* the pid that last registered with the registry; registration happens once
+ * per process.  Callers of mochi_plumber_job_partition() serialize access.
+ */
+static pid_t registered_pid = -1;
+
+static int job_register(const char* job_id, hwloc_const_cpuset_t cpuset);
+static int job_cpuset(const char* path, hwloc_bitmap_t job, hwloc_bitmap_t tmp);
+static int job_open(const char* path, int flags);
+
+const char* mochi_plumber_job_id(void)
+{
+    const char* id;
+    size_t      i;
+
+    for (i = 0; i < sizeof(job_id_vars) / sizeof(job_id_vars[0]); i++) {
+        id = getenv(job_id_vars[i]);
+        /* the ID becomes a file name, so don't accept anything odd */
+        if (id && strlen(id) && id[0] != '.' && !strchr(id, '/')) return (id);
+    }
+
+    return (NULL);
+}
+
+int mochi_plumber_job_partition(hwloc_const_cpuset_t bucket_cpuset,
+                                hwloc_const_cpuset_t cpuset,
+                                int                  num_nics,
+                                int*                 first,
+                                int*                 count)
+{
+    const char*    job_id = mochi_plumber_job_id();
+    char           path[512];
+    DIR*           dir;
+    struct dirent* entry;
+    hwloc_bitmap_t job = NULL;
+    hwloc_bitmap_t tmp = NULL;
+    long           before = 0;
+    long           weight = 0;
+    long           total  = 0;
+    long           w;
+    int            end;
+    int            ret = -1;
+
+    if (!job_id) return (-1);
+    if (job_register(job_id, cpuset) < 0) return (-1);
+
+    job = hwloc_bitmap_alloc();
+    tmp = hwloc_bitmap_alloc();
+    dir = opendir(JOB_REGISTRY);
+    if (!job || !tmp || !dir) goto out;
+
+    /* weigh every live job by the PUs it holds in this bucket, ordering
+     * jobs by ID so that all processes agree on where each one's share is
+     */
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", JOB_REGISTRY, entry->d_name);
+        if (job_cpuset(path, job, tmp) < 0) continue;
+        hwloc_bitmap_and(job, job, bucket_cpuset);
+        w = hwloc_bitmap_weight(job);
+        total += w;
+        if (strcmp(entry->d_name, job_id) < 0)
+            before += w;
+        else if (strcmp(entry->d_name, job_id) == 0)
+            weight = w;
+    }
+    if (total == 0 || weight == 0) goto out;
+
+    /* A contiguous share of the NICs proportional to the job's PUs.  If
+     * there are more jobs than NICs, a job with too small a share still
+     * gets (and shares) one.
+     */
+    *first = num_nics * before / total;
+    end    = num_nics * (before + weight) / total;
+    if (*first >= num_nics) *first = num_nics - 1;
+    if (end <= *first) end = *first + 1;
+    *count = end - *first;
+    ret    = 0;
+
+out:
+    if (dir) closedir(dir);
+    hwloc_bitmap_free(job);
+    hwloc_bitmap_free(tmp);
+
+    return (ret);
+}
+
+long long mochi_plumber_job_stamp(void)
+{
+    struct stat st;
+
+    if (stat(JOB_REGISTRY, &st) < 0) return (0);
+
+    return ((long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+}
+
+/* record the calling process's PUs under its job, once per process */
+static int job_register(const char* job_id, hwloc_const_cpuset_t cpuset)
+{
+    char    path[512];
+    char    line[4096];
+    int     len;
+    int     fd;
+    ssize_t ret;
+
+    if (registered_pid == getpid()) return (0);
+
+    /* world-writable, but sticky so that users can't remove each other's
+     * files
+     */
+    if (mkdir(JOB_REGISTRY, 01777) == 0)
+        chmod(JOB_REGISTRY, 01777);
+    else if (errno != EEXIST) {
+        perror("mkdir");
+        fprintf(stderr, "Error: failed to create %s\n", JOB_REGISTRY);
+        return (-1);
+    }
+
+    len = snprintf(line, sizeof(line), "%d ", (int)getpid());
+    len += hwloc_bitmap_list_snprintf(line + len, sizeof(line) - len - 1,
+                                      cpuset);
+    if (len >= (int)sizeof(line) - 1) return (-1);
+    line[len++] = '\n';
+
+    snprintf(path, sizeof(path), "%s/%s", JOB_REGISTRY, job_id);
+    fd = job_open(path, O_WRONLY | O_APPEND | O_CREAT);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to open %s\n", path);
+        return (-1);
+    }
+    /* a single append, so that concurrent processes don't interleave */
+    ret = write(fd, line, len);
+    close(fd);
+    if (ret != len) return (-1);
+    /* appending doesn't change the directory, so touch it to tell processes
+     * that memoized a share that the jobs have changed
+     */
+    utimensat(AT_FDCWD, JOB_REGISTRY, NULL, 0);
+
+    registered_pid = getpid();
+    return (0);
+}
+
+/* Union of the PUs of the live processes registered in a job file.
+ * Returns -1 if the file can't be read or has no live processes.
+ */
+static int job_cpuset(const char* path, hwloc_bitmap_t job, hwloc_bitmap_t tmp)
+{
+    struct stat file;
+    struct stat proc;
+    char        proc_path[64];
+    char        cpus[4096];
+    FILE*       f;
+    int         fd;
+    int         pid;
+    int         live = 0;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return (-1);
+    if (fstat(fd, &file) < 0 || !S_ISREG(file.st_mode)
+        || !(f = fdopen(fd, "r"))) {
+        close(fd);
+        return (-1);
+    }
+
+    hwloc_bitmap_zero(job);
+    while (fscanf(f, "%d %4095s", &pid, cpus) == 2) {
+        /* the process must still exist and belong to the file's owner */
+        snprintf(proc_path, sizeof(proc_path), "/proc/%d", pid);
+        if (pid <= 0 || stat(proc_path, &proc) < 0
+            || proc.st_uid != file.st_uid)
+            continue;
+        if (hwloc_bitmap_list_sscanf(tmp, cpus) < 0) continue;
+        hwloc_bitmap_or(job, job, tmp);
+        live = 1;
+    }
+    fclose(f);
+
+    return (live ? 0 : -1);
+}
+
+/* Open a job file without following links that another user may have
+ * planted in the (world-writable) registry, and make sure that it is ours.
+ */
+static int job_open(const char* path, int flags)
+{
+    struct stat st;
+    int         fd;
+
+    fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return (-1);
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+        fprintf(stderr, "Error: %s is not a file of ours.\n", path);
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
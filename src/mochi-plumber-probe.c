@@ -0,0 +1,314 @@
+/**
+ * @file mochi-plumber-probe.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+#include <rdma/fi_errno.h>
+#include <hwloc.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber.h"
+#include "mochi-plumber-internal.h"
+
+/* number of untimed and timed loopback round trips per NIC and domain */
+#define PROBE_WARMUP     100
+#define PROBE_ITERATIONS 1000
+#define PROBE_MSG_SIZE   8
+
+struct probe_arg {
+    hwloc_topology_t* topology;
+    hwloc_obj_t       numa;
+    struct fi_info*   info;
+    double            latency; /* out: mean round trip in ns, < 0 on error */
+};
+
+static void* probe_thread(void* arg);
+static int   probe_loopback(struct fi_info* info, double* latency);
+static int   wait_for_completions(struct fid_cq* cq, int count);
+
+void mochi_plumber_affinity_path(char* path, size_t size)
+{
+    const char* env = getenv("MOCHI_PLUMBER_AFFINITY_FILE");
+
+    if (env)
+        snprintf(path, size, "%s", env);
+    else {
+        mochi_plumber_user_dir(path, size);
+        snprintf(path + strlen(path), size - strlen(path), "/affinity");
+    }
+}
+
+int mochi_plumber_affinity_read(const char*                     path,
+                                int*                            num_entries,
+                                struct mochi_plumber_affinity** entries)
+{
+    FILE*                          f;
+    char                           line[256];
+    struct mochi_plumber_affinity  entry;
+    struct mochi_plumber_affinity* tmp;
+
+    *num_entries = 0;
+    *entries     = NULL;
+
+    f = fopen(path, "r");
+    if (!f) return (-1);
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %d %lf", entry.nic, &entry.numa, &entry.latency)
+            != 3)
+            continue;
+        tmp = realloc(*entries, (*num_entries + 1) * sizeof(**entries));
+        if (!tmp) {
+            free(*entries);
+            fclose(f);
+            return (-1);
+        }
+        *entries                 = tmp;
+        (*entries)[*num_entries] = entry;
+        (*num_entries)++;
+    }
+    fclose(f);
+
+    return (0);
+}
+
+int mochi_plumber_probe(const char* prov_name, const char* affinity_file)
+{
+    char             path[256];
+    char             dir[256];
+    char*            slash;
+    hwloc_topology_t topology;
+    struct fi_info*  hints;
+    struct fi_info*  info;
+    struct fi_info*  cur;
+    struct fi_info*  prev;
+    hwloc_obj_t      numa = NULL;
+    pthread_t        tid;
+    struct probe_arg arg;
+    FILE*            f;
+    int              ret;
+
+    if (affinity_file)
+        snprintf(path, sizeof(path), "%s", affinity_file);
+    else
+        mochi_plumber_affinity_path(path, sizeof(path));
+
+    /* the default location shares a private directory with the roundrobin
+     * token files, which may not exist yet
+     */
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            fprintf(stderr, "Error: failed to create %s\n", dir);
+            return (-1);
+        }
+    }
+
+    /* we need endpoints that can send to themselves without registering
+     * local buffers
+     */
+    hints = fi_allocinfo();
+    assert(hints);
+    hints->caps                   = FI_MSG;
+    hints->mode                   = FI_CONTEXT | FI_CONTEXT2;
+    hints->ep_attr->type          = FI_EP_RDM;
+    hints->domain_attr->mr_mode   = FI_MR_VIRT_ADDR | FI_MR_ALLOCATED
+                                | FI_MR_PROV_KEY | FI_MR_ENDPOINT;
+    hints->fabric_attr->prov_name = strdup(prov_name);
+    ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION), NULL, NULL,
+                     0, hints, &info);
+    fi_freeinfo(hints);
+    if (ret != 0) {
+        fprintf(stderr, "fi_getinfo: %d (%s)\n", ret, fi_strerror(-ret));
+        return (-1);
+    }
+
+    f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        fprintf(stderr, "Error: failed to open %s\n", path);
+        fi_freeinfo(info);
+        return (-1);
+    }
+    fprintf(f, "# provider %s\n", prov_name);
+    fprintf(f, "#<name> <NUMA domain> <mean round trip ns>\n");
+
+    hwloc_topology_init(&topology);
+    hwloc_topology_load(topology);
+
+    /* Measure each NIC from a thread bound to each NUMA domain in turn.
+     * Threads run one at a time so that measurements don't interfere with
+     * each other.
+     */
+    while ((numa = hwloc_get_next_obj_by_type(topology, HWLOC_OBJ_NUMANODE,
+                                              numa))) {
+        /* memory-only domains have no cores to run a thread on */
+        if (hwloc_bitmap_iszero(numa->cpuset)) continue;
+
+        for (cur = info; cur; cur = cur->next) {
+            /* providers may list several entries for one domain */
+            for (prev = info; prev != cur; prev = prev->next) {
+                if (strcmp(prev->domain_attr->name, cur->domain_attr->name)
+                    == 0)
+                    break;
+            }
+            if (prev != cur) continue;
+
+            arg.topology = &topology;
+            arg.numa     = numa;
+            arg.info     = cur;
+            arg.latency  = -1;
+            ret          = pthread_create(&tid, NULL, probe_thread, &arg);
+            if (ret != 0) {
+                fprintf(stderr, "Error: pthread_create() failure.\n");
+                continue;
+            }
+            pthread_join(tid, NULL);
+
+            if (arg.latency < 0) {
+                fprintf(stderr,
+                        "Warning: unable to probe %s from NUMA domain %u.\n",
+                        cur->domain_attr->name, numa->os_index);
+                continue;
+            }
+            fprintf(f, "%s %u %.1f\n", cur->domain_attr->name, numa->os_index,
+                    arg.latency);
+        }
+    }
+
+    hwloc_topology_destroy(topology);
+    fi_freeinfo(info);
+    fclose(f);
+
+    return (0);
+}
+
+static void* probe_thread(void* arg)
+{
+    struct probe_arg* parg = arg;
+    int               ret;
+
+    /* bind before opening any resources so that buffers and provider state
+     * are allocated in the domain being measured
+     */
+    ret = hwloc_set_cpubind(*parg->topology, parg->numa->cpuset,
+                            HWLOC_CPUBIND_THREAD);
+    if (ret < 0) {
+        fprintf(stderr, "hwloc_set_cpubind() failure.\n");
+        return (NULL);
+    }
+
+    probe_loopback(parg->info, &parg->latency);
+
+    return (NULL);
+}
+
+/* open an endpoint on the NIC and time messages sent to itself */
+static int probe_loopback(struct fi_info* info, double* latency)
+{
+    struct fid_fabric* fabric = NULL;
+    struct fid_domain* domain = NULL;
+    struct fid_cq*     cq     = NULL;
+    struct fid_av*     av     = NULL;
+    struct fid_ep*     ep     = NULL;
+    struct fi_cq_attr  cq_attr;
+    struct fi_av_attr  av_attr;
+    struct fi_context2 send_ctx;
+    struct fi_context2 recv_ctx;
+    char               addr[256];
+    size_t             addrlen = sizeof(addr);
+    fi_addr_t          self;
+    char               send_buf[PROBE_MSG_SIZE] = {0};
+    char               recv_buf[PROBE_MSG_SIZE];
+    struct timespec    start;
+    struct timespec    end;
+    int                ret;
+    int                i;
+
+    memset(&cq_attr, 0, sizeof(cq_attr));
+    cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+    memset(&av_attr, 0, sizeof(av_attr));
+    av_attr.type = FI_AV_UNSPEC;
+
+    ret = fi_fabric(info->fabric_attr, &fabric, NULL);
+    if (ret == 0) ret = fi_domain(fabric, info, &domain, NULL);
+    if (ret == 0) ret = fi_cq_open(domain, &cq_attr, &cq, NULL);
+    if (ret == 0) ret = fi_av_open(domain, &av_attr, &av, NULL);
+    if (ret == 0) ret = fi_endpoint(domain, info, &ep, NULL);
+    if (ret == 0) ret = fi_ep_bind(ep, &cq->fid, FI_TRANSMIT | FI_RECV);
+    if (ret == 0) ret = fi_ep_bind(ep, &av->fid, 0);
+    if (ret == 0) ret = fi_enable(ep);
+    if (ret == 0) ret = fi_getname(&ep->fid, addr, &addrlen);
+    if (ret == 0 && fi_av_insert(av, addr, 1, &self, 0, NULL) != 1) ret = -1;
+    if (ret != 0) {
+        fprintf(stderr, "Error: unable to open %s endpoint: %d (%s)\n",
+                info->domain_attr->name, ret, fi_strerror(-ret));
+        goto out;
+    }
+
+    for (i = 0; i < PROBE_WARMUP + PROBE_ITERATIONS; i++) {
+        if (i == PROBE_WARMUP) clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = fi_recv(ep, recv_buf, sizeof(recv_buf), NULL, FI_ADDR_UNSPEC,
+                      &recv_ctx);
+        if (ret == 0) {
+            do {
+                ret = fi_send(ep, send_buf, sizeof(send_buf), NULL, self,
+                              &send_ctx);
+            } while (ret == -FI_EAGAIN);
+        }
+        if (ret == 0) ret = wait_for_completions(cq, 2);
+        if (ret != 0) {
+            fprintf(stderr, "Error: loopback message on %s failed: %d (%s)\n",
+                    info->domain_attr->name, ret, fi_strerror(-ret));
+            goto out;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *latency = ((end.tv_sec - start.tv_sec) * 1e9
+                + (end.tv_nsec - start.tv_nsec))
+             / PROBE_ITERATIONS;
+
+out:
+    if (ep) fi_close(&ep->fid);
+    if (av) fi_close(&av->fid);
+    if (cq) fi_close(&cq->fid);
+    if (domain) fi_close(&domain->fid);
+    if (fabric) fi_close(&fabric->fid);
+
+    return (ret);
+}
+
+static int wait_for_completions(struct fid_cq* cq, int count)
+{
+    struct fi_cq_entry entry;
+    ssize_t            ret;
+
+    while (count > 0) {
+        ret = fi_cq_read(cq, &entry, 1);
+        if (ret == 1)
+            count--;
+        else if (ret != -FI_EAGAIN)
+            return (ret);
+    }
+
+    return (0);
+}
@@ -11,6 +11,8 @@
 #include <assert.h>
 #include <string.h>
 #include <sched.h>
+#include <dirent.h>
+#include <time.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
@@ -18,17 +20,36 @@
 #include <hwloc.h>
 
 #include "mochi-plumber.h"
+#include "mochi-plumber-internal.h"
 
 struct options {
-    char prov_name[256];
+    char   prov_name[256];
+    char   affinity_file[256]; /* probe NIC affinity and write it here */
+    double watch_interval;     /* seconds between samples; 0 to not watch */
+    int    watch_count;        /* number of samples; 0 for no limit */
+    double watch_threshold;    /* imbalance (percent from mean) to flag */
+    char   sysfs_root[256];    /* where to find NIC counters */
+    char   trace_dir[256];     /* summarize the traces in this directory */
+    char   merge_file[256];    /* and write them here in time order */
+    int    json;               /* print the node's layout as JSON */
 };
 
 struct nic {
-    char         iface_name[256];
-    unsigned int domain_id;
-    unsigned int bus_id;
-    unsigned int device_id;
-    unsigned int function_id;
+    char           iface_name[256];
+    unsigned int   domain_id;
+    unsigned int   bus_id;
+    unsigned int   device_id;
+    unsigned int   function_id;
+    hwloc_bitmap_t cpuset;  /* local PUs, or NULL if unknown */
+    hwloc_bitmap_t nodeset; /* local NUMA domains, or NULL if unknown */
+};
+
+/* cumulative traffic through a NIC */
+struct nic_counters {
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long rx_packets;
+    unsigned long long tx_packets;
 };
 
 struct test_combo {
@@ -49,9 +70,39 @@ struct test_combo test_combos[]
        {.bucket_policy = "numa", .nic_policy = "random"},
        {.bucket_policy = "numa", .nic_policy = "bycore"},
        {.bucket_policy = "numa", .nic_policy = "byset"},
+       {.bucket_policy = "l3", .nic_policy = "roundrobin"},
+       {.bucket_policy = "l3", .nic_policy = "random"},
+       {.bucket_policy = "l3", .nic_policy = "bycore"},
+       {.bucket_policy = "l3", .nic_policy = "byset"},
+       {.bucket_policy = "numa", .nic_policy = "irq"},
        {.bucket_policy = "passthrough", .nic_policy = "passthrough"},
        {0}};
 
+/* one line of a trace file */
+struct trace_record {
+    double time;
+    int    file; /* each file is one process */
+    char*  line;
+};
+
+/* resolutions counted under some key (e.g., a NIC) */
+struct trace_tally {
+    char key[320];
+    int  records;
+    int  processes;
+    int  last_file;
+    long total_ns;
+    long max_ns;
+};
+
+/* exercised only after probing, when an affinity table is available */
+struct test_combo measured_combos[]
+    = {{.bucket_policy = "measured", .nic_policy = "roundrobin"},
+       {.bucket_policy = "measured", .nic_policy = "random"},
+       {.bucket_policy = "measured", .nic_policy = "bycore"},
+       {.bucket_policy = "measured", .nic_policy = "byset"},
+       {0}};
+
 #if 0
 static int print_short_info(struct fi_info* info);
 #endif
@@ -59,38 +110,85 @@ static int  parse_args(int argc, char** argv, struct options* opts);
 static int  find_nics(struct options* opts, int* num_nics, struct nic** nics);
 static void usage(void);
 static int  count_packages(hwloc_topology_t* topology);
-static int  find_cores(struct options* opts,
-                       pid_t*          pid,
-                       int*            num_cores,
-                       int*            num_numa,
-                       int*            num_packages,
-                       int*            current_core,
-                       int*            current_numa,
-                       int*            current_package);
-
-static int check_locality(struct options* opts,
-                          int             num_cores,
-                          int             num_numa,
-                          int             num_packages,
-                          int             num_nics,
-                          struct nic*     nics);
+static int  print_affinity(const char* affinity_file);
+static void resolve_combos(struct options* opts, struct test_combo* combos);
+static int  open_topology(hwloc_topology_t* topology);
+static int  find_cores(struct options*  opts,
+                       hwloc_topology_t topology,
+                       pid_t*           pid,
+                       int*             num_cores,
+                       int*             num_numa,
+                       int*             num_packages,
+                       int*             current_core,
+                       int*             current_numa,
+                       int*             current_package);
+static void find_localities(hwloc_topology_t topology,
+                            int              num_nics,
+                            struct nic*      nics);
+
+static int  check_locality(struct options*  opts,
+                           hwloc_topology_t topology,
+                           int              num_nics,
+                           struct nic*      nics);
+static int  print_json(struct options*  opts,
+                       hwloc_topology_t topology,
+                       int              num_nics,
+                       struct nic*      nics,
+                       pid_t            pid,
+                       int              current_core,
+                       int              current_numa,
+                       int              current_package);
+static void print_json_bitmap(const char* key, hwloc_const_bitmap_t bitmap);
+static int watch_nics(struct options*  opts,
+                      hwloc_topology_t topology,
+                      int              num_nics,
+                      struct nic*      nics);
+static int read_nic_counters(const char*          sysfs_root,
+                             struct nic*          nic,
+                             struct nic_counters* counters);
+static int read_cxi_telemetry(const char* dir, unsigned long long* values);
+static int read_telemetry_file(const char* path, unsigned long long* value);
+static int sum_counter_files(const char*         dir,
+                             const char* const*  names,
+                             unsigned long long* values,
+                             int                 scale);
+static double
+counter_rate(unsigned long long before, unsigned long long after, double secs);
+static int  summarize_trace(struct options* opts);
+static int  read_trace_dir(const char*           dir,
+                           int*                  num_files,
+                           int*                  num_records,
+                           struct trace_record** records);
+static int  compare_records(const void* a, const void* b);
+static int  trace_field(const char* line,
+                        const char* key,
+                        char*       buf,
+                        size_t      size);
+static int  tally(struct trace_tally** tallies,
+                  int*                 num_tallies,
+                  const char*          key,
+                  int                  file,
+                  long                 ns);
+static void print_tallies(const char*         title,
+                          struct trace_tally* tallies,
+                          int                 num_tallies);
 
 int main(int argc, char** argv)
 {
-    struct options opts;
-    struct nic*    nics = NULL;
-    int            num_nics;
-    int            num_cores;
-    int            num_numa;
-    int            num_packages;
-    int            current_core;
-    int            current_numa;
-    int            current_package;
-    pid_t          pid;
-    int            ret;
-    int            i;
-    char           hostname[256] = {0};
-    char*          out_addr      = NULL;
+    struct options   opts;
+    struct nic*      nics = NULL;
+    int              num_nics;
+    int              num_cores;
+    int              num_numa;
+    int              num_packages;
+    int              current_core;
+    int              current_numa;
+    int              current_package;
+    pid_t            pid;
+    hwloc_topology_t topology;
+    int              ret;
+    int              i;
+    char             hostname[256] = {0};
 
     ret = parse_args(argc, argv, &opts);
     if (ret < 0) {
@@ -98,6 +196,9 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
+    /* post-mortem of traced resolutions rather than a look at this node */
+    if (strlen(opts.trace_dir)) return (summarize_trace(&opts));
+
     /* get an array of network interfaces with device ids */
     ret = find_nics(&opts, &num_nics, &nics);
     if (ret < 0) {
@@ -105,14 +206,31 @@ int main(int argc, char** argv)
         return (-1);
     }
 
+    /* everything below is drawn from one pass over the topology */
+    ret = open_topology(&topology);
+    if (ret < 0) {
+        fprintf(stderr, "Error: unable to load topology.\n");
+        return (-1);
+    }
+
     /* get array of cpu ids */
-    ret = find_cores(&opts, &pid, &num_cores, &num_numa, &num_packages,
-                     &current_core, &current_numa, &current_package);
+    ret = find_cores(&opts, topology, &pid, &num_cores, &num_numa,
+                     &num_packages, &current_core, &current_numa,
+                     &current_package);
     if (ret < 0) {
         fprintf(stderr, "Error: unable to find CPUs.\n");
         return (-1);
     }
 
+    /* and which of them each nic is local to */
+    find_localities(topology, num_nics, nics);
+
+    if (opts.json) {
+        ret = print_json(&opts, topology, num_nics, nics, pid, current_core,
+                         current_numa, current_package);
+        goto out;
+    }
+
     gethostname(hostname, 255);
     printf("Host:\n");
     printf("\t%s\n", hostname);
@@ -133,42 +251,121 @@ int main(int argc, char** argv)
     }
 
     /* check locality of all permutations */
-    ret = check_locality(&opts, num_cores, num_numa, num_packages, num_nics,
-                         nics);
+    ret = check_locality(&opts, topology, num_nics, nics);
     if (ret < 0) {
         fprintf(stderr, "Error: check_locality() failure.\n");
         return (-1);
     }
 
-    if (nics) free(nics);
+    /* measure NIC affinity rather than inferring it from the topology */
+    if (strlen(opts.affinity_file)) {
+        ret = mochi_plumber_probe(opts.prov_name, opts.affinity_file);
+        if (ret < 0) {
+            fprintf(stderr, "Error: mochi_plumber_probe() failure.\n");
+            return (-1);
+        }
+        ret = print_affinity(opts.affinity_file);
+        if (ret < 0) {
+            fprintf(stderr, "Error: unable to read %s.\n", opts.affinity_file);
+            return (-1);
+        }
+        /* point the "measured" bucket policy at the table we just wrote */
+        setenv("MOCHI_PLUMBER_AFFINITY_FILE", opts.affinity_file, 1);
+    }
 
     /* exercise programmatic fn for resolving addresses to specific NICs */
     printf("\nmochi_plumber_resolve_nic() test cases:\n");
     printf("\t#<bucket policy>\t<NIC policy>\t<in addr>\t<out addr>\n");
 
+    resolve_combos(&opts, test_combos);
+    if (strlen(opts.affinity_file)) resolve_combos(&opts, measured_combos);
+
+    /* sample live traffic to see how well the NICs are being balanced */
+    if (opts.watch_interval > 0) {
+        ret = watch_nics(&opts, topology, num_nics, nics);
+        if (ret < 0) {
+            fprintf(stderr, "Error: watch_nics() failure.\n");
+            return (-1);
+        }
+    }
+
+out:
+    for (i = 0; i < num_nics; i++) {
+        hwloc_bitmap_free(nics[i].cpuset);
+        hwloc_bitmap_free(nics[i].nodeset);
+    }
+    if (nics) free(nics);
+    hwloc_topology_destroy(topology);
+
+    return (ret < 0 ? -1 : 0);
+}
+
+static void resolve_combos(struct options* opts, struct test_combo* combos)
+{
+    int   ret;
+    int   i;
+    char* out_addr = NULL;
+
     i = 0;
-    while (test_combos[i].bucket_policy) {
-        ret = mochi_plumber_resolve_nic(opts.prov_name,
-                                        test_combos[i].bucket_policy,
-                                        test_combos[i].nic_policy, &out_addr);
+    while (combos[i].bucket_policy) {
+        ret = mochi_plumber_resolve_nic(opts->prov_name,
+                                        combos[i].bucket_policy,
+                                        combos[i].nic_policy, &out_addr);
         if (ret == 0) {
-            printf("\t%10s\t%12s\t%s\t%s\n", test_combos[i].bucket_policy,
-                   test_combos[i].nic_policy, opts.prov_name, out_addr);
+            printf("\t%10s\t%12s\t%s\t%s\n", combos[i].bucket_policy,
+                   combos[i].nic_policy, opts->prov_name, out_addr);
             if (out_addr) free(out_addr);
             out_addr = NULL;
         } else {
-            printf("\t%10s\t%12s\t%s\tN/A\n", test_combos[i].bucket_policy,
-                   test_combos[i].nic_policy, opts.prov_name);
+            printf("\t%10s\t%12s\t%s\tN/A\n", combos[i].bucket_policy,
+                   combos[i].nic_policy, opts->prov_name);
         }
         i++;
     }
+}
+
+static int print_affinity(const char* affinity_file)
+{
+    FILE* f;
+    char  line[256];
+
+    f = fopen(affinity_file, "r");
+    if (!f) return (-1);
+
+    printf("\nMeasured NIC affinity:\n");
+    while (fgets(line, sizeof(line), f)) {
+        /* skip the provider comment; the column header is printed as is */
+        if (strncmp(line, "# ", 2) == 0) continue;
+        printf("\t%s", line);
+    }
+    fclose(f);
 
     return (0);
 }
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: ofi-dm-query -p <provider_name>\n");
+    fprintf(stderr,
+            "Usage: ofi-dm-query -p <provider_name> [-m <affinity_file>]\n"
+            "\t[-w <seconds> [-n <samples>] [-t <percent>] [-r <root>]]\n"
+            "       ofi-dm-query -p <provider_name> -j\n"
+            "       ofi-dm-query -T <trace_dir> [-o <merged_file>]\n");
+    fprintf(stderr, "\t-m: measure NIC affinity and write it to a file\n");
+    fprintf(stderr, "\t-w: sample NIC traffic counters at this interval\n");
+    fprintf(stderr,
+            "\t    (cxi telemetry, or network interface and InfiniBand port "
+            "counters)\n");
+    fprintf(stderr, "\t-n: stop after this many samples (default: never)\n");
+    fprintf(stderr,
+            "\t-t: flag NICs this far from the mean throughput "
+            "(default: 25)\n");
+    fprintf(stderr,
+            "\t-r: read counters below this directory instead of /sys\n");
+    fprintf(stderr,
+            "\t-T: summarize the MOCHI_PLUMBER_TRACE files in a directory\n");
+    fprintf(stderr, "\t-o: also merge them into one file in time order\n");
+    fprintf(stderr,
+            "\t-j: print NIC locality and resolutions as one line of JSON\n");
     return;
 }
 
@@ -178,19 +375,59 @@ static int parse_args(int argc, char** argv, struct options* opts)
     int ret;
 
     memset(opts, 0, sizeof(*opts));
+    opts->watch_threshold = 25;
+    strcpy(opts->sysfs_root, "/sys");
 
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:m:w:n:t:r:T:o:j")) != -1) {
         switch (opt) {
         case 'p':
             ret = sscanf(optarg, "%s", opts->prov_name);
             if (ret != 1) return (-1);
             break;
+        case 'm':
+            ret = sscanf(optarg, "%255s", opts->affinity_file);
+            if (ret != 1) return (-1);
+            break;
+        case 'w':
+            ret = sscanf(optarg, "%lf", &opts->watch_interval);
+            if (ret != 1 || opts->watch_interval <= 0) return (-1);
+            break;
+        case 'n':
+            ret = sscanf(optarg, "%d", &opts->watch_count);
+            if (ret != 1 || opts->watch_count < 1) return (-1);
+            break;
+        case 't':
+            ret = sscanf(optarg, "%lf", &opts->watch_threshold);
+            if (ret != 1 || opts->watch_threshold < 0) return (-1);
+            break;
+        case 'r':
+            ret = sscanf(optarg, "%255s", opts->sysfs_root);
+            if (ret != 1) return (-1);
+            break;
+        case 'T':
+            ret = sscanf(optarg, "%255s", opts->trace_dir);
+            if (ret != 1) return (-1);
+            break;
+        case 'o':
+            ret = sscanf(optarg, "%255s", opts->merge_file);
+            if (ret != 1) return (-1);
+            break;
+        case 'j':
+            opts->json = 1;
+            break;
         default:
             return (-1);
         }
     }
 
-    if (strlen(opts->prov_name) == 0) return (-1);
+    if (strlen(opts->merge_file) && strlen(opts->trace_dir) == 0) return (-1);
+    /* nothing else may write to stdout */
+    if (opts->json
+        && (strlen(opts->affinity_file) || opts->watch_interval > 0
+            || strlen(opts->trace_dir)))
+        return (-1);
+    if (strlen(opts->prov_name) == 0 && strlen(opts->trace_dir) == 0)
+        return (-1);
 
     return (0);
 }
@@ -293,16 +530,30 @@ static int find_nics(struct options* opts, int* num_nics, struct nic** nics)
     return (0);
 }
 
-static int find_cores(struct options* opts,
-                      pid_t*          pid,
-                      int*            num_cores,
-                      int*            num_numa,
-                      int*            num_packages,
-                      int*            current_core,
-                      int*            current_numa,
-                      int*            current_package)
+/* load the topology, including the PCI devices that NICs are found by */
+static int open_topology(hwloc_topology_t* topology)
+{
+    if (hwloc_topology_init(topology) < 0) return (-1);
+    hwloc_topology_set_io_types_filter(*topology,
+                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
+    if (hwloc_topology_load(*topology) < 0) {
+        hwloc_topology_destroy(*topology);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static int find_cores(struct options*  opts,
+                      hwloc_topology_t topology,
+                      pid_t*           pid,
+                      int*             num_cores,
+                      int*             num_numa,
+                      int*             num_packages,
+                      int*             current_core,
+                      int*             current_numa,
+                      int*             current_package)
 {
-    hwloc_topology_t     topology;
     hwloc_obj_t          package;
     hwloc_obj_t          covering;
     hwloc_cpuset_t       last_cpu;
@@ -314,13 +565,9 @@ static int find_cores(struct options* opts,
     /* local process info */
     *pid = getpid();
 
-    /* get topology */
-    hwloc_topology_init(&topology);
-    hwloc_topology_load(topology);
-
-    /* query all PUs */
-    cset_all      = hwloc_topology_get_complete_cpuset(topology);
-    nset_all      = hwloc_topology_get_complete_nodeset(topology);
+    /* query the PUs and NUMA domains that this process may use */
+    cset_all      = hwloc_topology_get_allowed_cpuset(topology);
+    nset_all      = hwloc_topology_get_allowed_nodeset(topology);
     *num_cores    = hwloc_bitmap_weight(cset_all);
     *num_numa     = hwloc_bitmap_weight(nset_all);
     *num_packages = count_packages(&topology);
@@ -348,8 +595,8 @@ static int find_cores(struct options* opts,
     covering      = hwloc_get_obj_covering_cpuset(topology, last_cpu);
     package
         = hwloc_get_ancestor_obj_by_type(topology, HWLOC_OBJ_PACKAGE, covering);
-    assert(package->type == HWLOC_OBJ_PACKAGE);
-    *current_package = package->os_index;
+    /* e.g., a loaded topology that doesn't match the cgroup */
+    *current_package = package ? (int)package->os_index : -1;
 
 #if 0
     /* sanity check vs sched_getcpu */
@@ -360,125 +607,156 @@ static int find_cores(struct options* opts,
 
     hwloc_bitmap_free(last_cpu);
     hwloc_bitmap_free(last_numa);
-    hwloc_topology_destroy(topology);
 
     return (0);
 }
 
-static int check_locality(struct options* opts,
-                          int             num_cores,
-                          int             num_numa,
-                          int             num_packages,
-                          int             num_nics,
-                          struct nic*     nics)
+/* Find the PUs and NUMA domains local to each nic: those of its first
+ * non-io ancestor, or according to /sys if /sys is partially masked and
+ * hwloc can't see it.  Localities that are still unknown are left NULL.
+ */
+static void find_localities(hwloc_topology_t topology,
+                            int              num_nics,
+                            struct nic*      nics)
 {
-    int              i;
-    int              j;
-    hwloc_cpuset_t   cpu;
-    hwloc_nodeset_t  numa;
-    hwloc_obj_t      non_io_ancestor;
-    hwloc_obj_t      package_ancestor;
-    hwloc_obj_t      pci_dev;
-    hwloc_topology_t topology;
-    int              ret;
-
-    hwloc_topology_init(&topology);
-    ret = hwloc_topology_set_io_types_filter(topology,
-                                             HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
-    assert(ret == 0);
-    hwloc_topology_load(topology);
-
-    cpu  = hwloc_bitmap_alloc();
-    numa = hwloc_bitmap_alloc();
-
-    printf("\nCore locality map:\n");
-    printf("\t#<name> <core mask...>\n");
+    hwloc_obj_t non_io_ancestor;
+    hwloc_obj_t pci_dev;
+    int         i;
 
-    /* loop through each nic and find its first non-io ancestor */
     for (i = 0; i < num_nics; i++) {
+        nics[i].cpuset  = hwloc_bitmap_alloc();
+        nics[i].nodeset = hwloc_bitmap_alloc();
+        if (!nics[i].cpuset || !nics[i].nodeset) goto unknown;
+
         pci_dev = hwloc_get_pcidev_by_busid(topology, nics[i].domain_id,
                                             nics[i].bus_id, nics[i].device_id,
                                             nics[i].function_id);
-        if (pci_dev)
+        if (pci_dev) {
             non_io_ancestor = hwloc_get_non_io_ancestor_obj(topology, pci_dev);
-        else {
-            fprintf(stderr, "Error: could not find pci_dev in topology.\n");
-            return (-1);
+            hwloc_bitmap_copy(nics[i].cpuset, non_io_ancestor->cpuset);
+            hwloc_bitmap_copy(nics[i].nodeset, non_io_ancestor->nodeset);
+            continue;
+        }
+        if (mochi_plumber_pci_cpuset(topology, nics[i].domain_id,
+                                     nics[i].bus_id, nics[i].device_id,
+                                     nics[i].function_id, nics[i].cpuset)
+            == 0) {
+            hwloc_cpuset_to_nodeset(topology, nics[i].cpuset, nics[i].nodeset);
+            continue;
         }
 
-        /* loop through every possible core id (assume they go from 0 to
-         * num_cores-1) and check if it reports its locality to each nic.
-         */
-        printf("\t%s ", nics[i].iface_name);
-        for (j = 0; j < num_cores; j++) {
-            /* construct a cpu bitmap for core N */
-            hwloc_bitmap_only(cpu, j);
+        fprintf(stderr, "Warning: locality of %s is unknown.\n",
+                nics[i].iface_name);
+    unknown:
+        hwloc_bitmap_free(nics[i].cpuset);
+        hwloc_bitmap_free(nics[i].nodeset);
+        nics[i].cpuset  = NULL;
+        nics[i].nodeset = NULL;
+    }
+}
+
+static int check_locality(struct options*  opts,
+                          hwloc_topology_t topology,
+                          int              num_nics,
+                          struct nic*      nics)
+{
+    int                  i;
+    int                  j;
+    int                  ret;
+    hwloc_cpuset_t       cpu;
+    hwloc_obj_t          package;
+    hwloc_const_bitmap_t cset_all;
+    hwloc_const_bitmap_t nset_all;
+    char                 list[1024];
 
-            /* see if it is in the cpuset */
-            if (non_io_ancestor
-                && hwloc_bitmap_isincluded(cpu, non_io_ancestor->cpuset))
+    /* only the PUs and NUMA domains that this process may use (e.g.,
+     * within its cgroup), which need not be numbered from 0
+     */
+    cset_all = hwloc_topology_get_allowed_cpuset(topology);
+    nset_all = hwloc_topology_get_allowed_nodeset(topology);
+
+    cpu = hwloc_bitmap_alloc();
+    if (!cpu) {
+        fprintf(stderr, "Error: allocation failure.\n");
+        return (-1);
+    }
+
+    hwloc_bitmap_list_snprintf(list, sizeof(list), cset_all);
+    printf("\nCore locality map (PUs %s):\n", list);
+    printf("\t#<name> <core mask...>\n");
+
+    /* check if each PU reports its locality to each nic */
+    for (i = 0; i < num_nics; i++) {
+        printf("\t%s ", nics[i].iface_name);
+        hwloc_bitmap_foreach_begin(j, cset_all)
+        {
+            if (!nics[i].cpuset)
+                printf("?");
+            else if (hwloc_bitmap_isset(nics[i].cpuset, j))
                 printf("1");
             else
                 printf("0");
         }
+        hwloc_bitmap_foreach_end();
         printf("\n");
     }
 
-    printf("\nNUMA locality map:\n");
-    printf("\t#<name> <NUMA mask...>\n");
+    printf("\nIRQ locality map (PUs %s):\n", list);
+    printf("\t#<name> <core mask...>\n");
 
-    /* loop through each nic and find its first non-io ancestor */
+    /* mark the cores that each nic's interrupts are delivered to */
     for (i = 0; i < num_nics; i++) {
-        pci_dev = hwloc_get_pcidev_by_busid(topology, nics[i].domain_id,
-                                            nics[i].bus_id, nics[i].device_id,
-                                            nics[i].function_id);
-        if (pci_dev)
-            non_io_ancestor = hwloc_get_non_io_ancestor_obj(topology, pci_dev);
-        else {
-            fprintf(stderr, "Error: could not find pci_dev in topology.\n");
-            return (-1);
+        ret = mochi_plumber_irq_cpuset(nics[i].domain_id, nics[i].bus_id,
+                                       nics[i].device_id, nics[i].function_id,
+                                       cpu);
+        printf("\t%s ", nics[i].iface_name);
+        hwloc_bitmap_foreach_begin(j, cset_all)
+        {
+            if (ret < 0)
+                printf("?");
+            else if (hwloc_bitmap_isset(cpu, j))
+                printf("1");
+            else
+                printf("0");
         }
+        hwloc_bitmap_foreach_end();
+        printf("\n");
+    }
 
-        /* loop through every possible numa id and check if it reports its
-         * locality to each nic.
-         */
-        printf("\t%s ", nics[i].iface_name);
-        for (j = 0; j < num_numa; j++) {
-            /* construct a cpu bitmap for NUMA N */
-            hwloc_bitmap_only(numa, j);
+    hwloc_bitmap_list_snprintf(list, sizeof(list), nset_all);
+    printf("\nNUMA locality map (NUMA domains %s):\n", list);
+    printf("\t#<name> <NUMA mask...>\n");
 
-            /* see if it is in the cpuset */
-            if (non_io_ancestor
-                && hwloc_bitmap_isincluded(numa, non_io_ancestor->nodeset))
+    /* check if each NUMA domain reports its locality to each nic */
+    for (i = 0; i < num_nics; i++) {
+        printf("\t%s ", nics[i].iface_name);
+        hwloc_bitmap_foreach_begin(j, nset_all)
+        {
+            if (!nics[i].nodeset)
+                printf("?");
+            else if (hwloc_bitmap_isset(nics[i].nodeset, j))
                 printf("1");
             else
                 printf("0");
         }
+        hwloc_bitmap_foreach_end();
         printf("\n");
     }
 
     printf("\nPackage locality map:\n");
     printf("\t#<name> <Package mask...>\n");
 
-    /* loop through each nic and find its first package ancestor */
+    /* check if each package shares PUs with each nic */
     for (i = 0; i < num_nics; i++) {
-        pci_dev = hwloc_get_pcidev_by_busid(topology, nics[i].domain_id,
-                                            nics[i].bus_id, nics[i].device_id,
-                                            nics[i].function_id);
-        if (pci_dev)
-            package_ancestor = hwloc_get_ancestor_obj_by_type(
-                topology, HWLOC_OBJ_PACKAGE, pci_dev);
-        else {
-            fprintf(stderr, "Error: could not find pci_dev in topology.\n");
-            return (-1);
-        }
-
-        /* loop through every possible package id note if it is the ancestor
-         * to this device.
-         */
         printf("\t%s ", nics[i].iface_name);
-        for (j = 0; j < num_packages; j++) {
-            if (j == package_ancestor->os_index)
+        package = NULL;
+        while ((package = hwloc_get_next_obj_by_type(
+                    topology, HWLOC_OBJ_PACKAGE, package))) {
+            if (hwloc_bitmap_iszero(package->cpuset))
+                continue;
+            else if (!nics[i].cpuset)
+                printf("?");
+            else if (hwloc_bitmap_intersects(package->cpuset, nics[i].cpuset))
                 printf("1");
             else
                 printf("0");
@@ -487,23 +765,673 @@ static int check_locality(struct options* opts,
     }
 
     hwloc_bitmap_free(cpu);
-    hwloc_bitmap_free(numa);
-    hwloc_topology_destroy(topology);
 
     return (0);
 }
 
+/* Print what the text report shows about this node, other than traffic, as
+ * a single line of JSON, so that layouts are cheap to collect and compare
+ * across many nodes.  Sets of PUs, NUMA domains, and packages are given
+ * both as lists and as hex masks, and are limited to those this process
+ * may use.  Localities that are unknown are null.
+ */
+static int print_json(struct options*  opts,
+                      hwloc_topology_t topology,
+                      int              num_nics,
+                      struct nic*      nics,
+                      pid_t            pid,
+                      int              current_core,
+                      int              current_numa,
+                      int              current_package)
+{
+    char           hostname[256] = {0};
+    char           address[MOCHI_PLUMBER_ADDR_MAX];
+    hwloc_bitmap_t packages;
+    hwloc_bitmap_t bitmap;
+    hwloc_obj_t    package = NULL;
+    int            ret;
+    int            i;
+
+    packages = hwloc_bitmap_alloc();
+    bitmap   = hwloc_bitmap_alloc();
+    if (!packages || !bitmap) {
+        fprintf(stderr, "Error: allocation failure.\n");
+        hwloc_bitmap_free(packages);
+        hwloc_bitmap_free(bitmap);
+        return (-1);
+    }
+    while ((package = hwloc_get_next_obj_by_type(topology, HWLOC_OBJ_PACKAGE,
+                                                 package))) {
+        if (!hwloc_bitmap_iszero(package->cpuset))
+            hwloc_bitmap_set(packages, package->os_index);
+    }
+
+    gethostname(hostname, 255);
+    printf("{\"host\":");
+    mochi_plumber_json_string(stdout, hostname);
+    printf(",\"pid\":%d,\"cpu\":{\"pu\":%d,\"numa\":%d,\"package\":%d},",
+           (int)pid, current_core, current_numa, current_package);
+    print_json_bitmap("pus", hwloc_topology_get_allowed_cpuset(topology));
+    printf(",");
+    print_json_bitmap("numa", hwloc_topology_get_allowed_nodeset(topology));
+    printf(",");
+    print_json_bitmap("packages", packages);
+
+    printf(",\"nics\":[");
+    for (i = 0; i < num_nics; i++) {
+        printf("%s{\"name\":", i ? "," : "");
+        mochi_plumber_json_string(stdout, nics[i].iface_name);
+        printf(",\"pci\":\"%04x:%02x:%02x.%x\",", nics[i].domain_id,
+               nics[i].bus_id, nics[i].device_id, nics[i].function_id);
+        print_json_bitmap("pus", nics[i].cpuset);
+        printf(",");
+        print_json_bitmap("numa", nics[i].nodeset);
+        printf(",");
+
+        /* the packages that share PUs with the nic */
+        hwloc_bitmap_zero(bitmap);
+        package = NULL;
+        while (nics[i].cpuset
+               && (package = hwloc_get_next_obj_by_type(
+                       topology, HWLOC_OBJ_PACKAGE, package))) {
+            if (hwloc_bitmap_intersects(package->cpuset, nics[i].cpuset))
+                hwloc_bitmap_set(bitmap, package->os_index);
+        }
+        print_json_bitmap("packages", nics[i].cpuset ? bitmap : NULL);
+        printf(",");
+
+        ret = mochi_plumber_irq_cpuset(nics[i].domain_id, nics[i].bus_id,
+                                       nics[i].device_id, nics[i].function_id,
+                                       bitmap);
+        print_json_bitmap("irq", ret < 0 ? NULL : bitmap);
+        printf("}");
+    }
+
+    /* what each combination of policies resolves to for this process */
+    printf("],\"address\":");
+    mochi_plumber_json_string(stdout, opts->prov_name);
+    printf(",\"resolutions\":[");
+    for (i = 0; test_combos[i].bucket_policy; i++) {
+        ret = mochi_plumber_resolve_nic_buf(
+            opts->prov_name, test_combos[i].bucket_policy,
+            test_combos[i].nic_policy, address, sizeof(address));
+        printf("%s{\"bucket_policy\":\"%s\",\"nic_policy\":\"%s\",\"result\":",
+               i ? "," : "", test_combos[i].bucket_policy,
+               test_combos[i].nic_policy);
+        mochi_plumber_json_string(stdout, ret == 0 ? address : NULL);
+        printf("}");
+    }
+    printf("]}\n");
+
+    hwloc_bitmap_free(packages);
+    hwloc_bitmap_free(bitmap);
+
+    return (0);
+}
+
+/* print "key":{"list":...,"hex":...}, or "key":null for a NULL bitmap */
+static void print_json_bitmap(const char* key, hwloc_const_bitmap_t bitmap)
+{
+    char* list = NULL;
+    char* hex  = NULL;
+
+    printf("\"%s\":", key);
+    if (bitmap && hwloc_bitmap_list_asprintf(&list, bitmap) >= 0
+        && hwloc_bitmap_taskset_asprintf(&hex, bitmap) >= 0)
+        printf("{\"list\":\"%s\",\"hex\":\"%s\"}", list, hex);
+    else
+        printf("null");
+    free(list);
+    free(hex);
+}
+
+/* Periodically sample the traffic counters of each NIC and report the
+ * throughput of each alongside its NUMA domain and package, flagging NICs
+ * that carry more or less than the threshold away from the mean.  NICs
+ * whose counters could not be read at both ends of an interval are shown
+ * without rates and left out of the mean.
+ */
+static int watch_nics(struct options*  opts,
+                      hwloc_topology_t topology,
+                      int              num_nics,
+                      struct nic*      nics)
+{
+    hwloc_obj_t          package;
+    char (*numa)[64]     = NULL;
+    int*                 packages = NULL;
+    struct nic_counters* prev     = NULL;
+    struct nic_counters* cur      = NULL;
+    double*              rates    = NULL;
+    int*                 readable = NULL;
+    int*                 counted  = NULL;
+    struct timespec      then;
+    struct timespec      now;
+    struct timespec      delay;
+    double               elapsed;
+    double               mean;
+    double               deviation;
+    int                  num_counted;
+    int                  imbalanced;
+    int                  sample;
+    int                  ret = -1;
+    int                  i;
+
+    if (num_nics < 1) {
+        fprintf(stderr, "Error: no network cards to watch.\n");
+        return (-1);
+    }
+
+    numa     = calloc(num_nics, sizeof(*numa));
+    packages = calloc(num_nics, sizeof(*packages));
+    prev     = calloc(num_nics, sizeof(*prev));
+    cur      = calloc(num_nics, sizeof(*cur));
+    rates    = calloc(num_nics, sizeof(*rates));
+    readable = calloc(num_nics, sizeof(*readable));
+    counted  = calloc(num_nics, sizeof(*counted));
+    if (!numa || !packages || !prev || !cur || !rates || !readable
+        || !counted)
+        goto out;
+
+    /* the NUMA domain(s) and package that each NIC is local to */
+    for (i = 0; i < num_nics; i++) {
+        strcpy(numa[i], "-");
+        packages[i] = -1;
+        if (!nics[i].cpuset) continue;
+        hwloc_bitmap_list_snprintf(numa[i], sizeof(numa[i]), nics[i].nodeset);
+        package = hwloc_get_obj_covering_cpuset(topology, nics[i].cpuset);
+        if (package && package->type != HWLOC_OBJ_PACKAGE)
+            package = hwloc_get_ancestor_obj_by_type(
+                topology, HWLOC_OBJ_PACKAGE, package);
+        if (package) packages[i] = package->os_index;
+    }
+
+    for (i = 0; i < num_nics; i++) {
+        readable[i]
+            = read_nic_counters(opts->sysfs_root, &nics[i], &prev[i]) == 0;
+        if (!readable[i])
+            fprintf(stderr, "Warning: no traffic counters found for %s.\n",
+                    nics[i].iface_name);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &then);
+
+    printf("\nNIC traffic (every %.1f s, flagging %.0f%% from mean):\n",
+           opts->watch_interval, opts->watch_threshold);
+    printf("\t#<sample> <name> <NUMA> <package> <rx MB/s> <tx MB/s> "
+           "<rx Kpkt/s> <tx Kpkt/s>\n");
+
+    for (sample = 1; !opts->watch_count || sample <= opts->watch_count;
+         sample++) {
+        delay.tv_sec  = (time_t)opts->watch_interval;
+        delay.tv_nsec = (opts->watch_interval - delay.tv_sec) * 1e9;
+        nanosleep(&delay, NULL);
+
+        for (i = 0; i < num_nics; i++) {
+            counted[i] = readable[i];
+            readable[i]
+                = read_nic_counters(opts->sysfs_root, &nics[i], &cur[i]) == 0;
+            counted[i] = counted[i] && readable[i];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - then.tv_sec)
+                + (now.tv_nsec - then.tv_nsec) / 1e9;
+
+        mean        = 0;
+        num_counted = 0;
+        for (i = 0; i < num_nics; i++) {
+            if (!counted[i]) continue;
+            rates[i] = counter_rate(prev[i].rx_bytes, cur[i].rx_bytes, elapsed)
+                     + counter_rate(prev[i].tx_bytes, cur[i].tx_bytes, elapsed);
+            mean += rates[i];
+            num_counted++;
+        }
+        if (num_counted) mean /= num_counted;
+
+        imbalanced = 0;
+        for (i = 0; i < num_nics; i++) {
+            if (!counted[i]) {
+                printf("\t%d %s %s %d - - - -\n", sample, nics[i].iface_name,
+                       numa[i], packages[i]);
+                prev[i] = cur[i];
+                continue;
+            }
+            deviation = mean > 0 ? 100.0 * (rates[i] - mean) / mean : 0;
+            if (deviation > opts->watch_threshold
+                || -deviation > opts->watch_threshold)
+                imbalanced = 1;
+            printf("\t%d %s %s %d %.2f %.2f %.2f %.2f", sample,
+                   nics[i].iface_name, numa[i], packages[i],
+                   counter_rate(prev[i].rx_bytes, cur[i].rx_bytes, elapsed)
+                       / 1e6,
+                   counter_rate(prev[i].tx_bytes, cur[i].tx_bytes, elapsed)
+                       / 1e6,
+                   counter_rate(prev[i].rx_packets, cur[i].rx_packets, elapsed)
+                       / 1e3,
+                   counter_rate(prev[i].tx_packets, cur[i].tx_packets, elapsed)
+                       / 1e3);
+            if (deviation > opts->watch_threshold
+                || -deviation > opts->watch_threshold)
+                printf(" (%+.0f%%)", deviation);
+            printf("\n");
+            prev[i] = cur[i];
+        }
+        if (imbalanced)
+            printf("\t# sample %d: NIC traffic is imbalanced\n", sample);
+        fflush(stdout);
+        then = now;
+    }
+    ret = 0;
+
+out:
+    free(numa);
+    free(packages);
+    free(prev);
+    free(cur);
+    free(rates);
+    free(readable);
+    free(counted);
+
+    return (ret);
+}
+
+/* Read the cumulative counters for a NIC from sysfs.  A cxi device counts
+ * all of its traffic, including RDMA that bypasses its Ethernet interface,
+ * in class/cxi/<dev>/device/telemetry; otherwise the counters are summed
+ * over every network interface (net/<iface>/statistics) and InfiniBand port
+ * (infiniband/<dev>/ports/<n>/counters) of the PCI device.  Returns -1 if
+ * the device has no counters that we recognize.
+ */
+static int read_nic_counters(const char*          sysfs_root,
+                             struct nic*          nic,
+                             struct nic_counters* counters)
+{
+    static const char* const net_names[]
+        = {"rx_bytes", "tx_bytes", "rx_packets", "tx_packets"};
+    /* the IB data counters are in units of 4 bytes */
+    static const char* const ib_names[]
+        = {"port_rcv_data", "port_xmit_data", "port_rcv_packets",
+           "port_xmit_packets"};
+    char                     device[256];
+    char                     path[1280];
+    char                     ports[768];
+    unsigned long long       values[4] = {0};
+    DIR*                     dir;
+    DIR*                     port_dir;
+    struct dirent*           entry;
+    struct dirent*           port;
+    int                      found = 0;
+
+    snprintf(path, sizeof(path), "%s/class/cxi/%s/device/telemetry",
+             sysfs_root, nic->iface_name);
+    if (read_cxi_telemetry(path, values) == 0) {
+        found = 1;
+        goto out;
+    }
+
+    snprintf(device, sizeof(device), "%s/bus/pci/devices/%04x:%02x:%02x.%x",
+             sysfs_root, nic->domain_id, nic->bus_id, nic->device_id,
+             nic->function_id);
+
+    snprintf(path, sizeof(path), "%s/net", device);
+    dir = opendir(path);
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/net/%s/statistics", device,
+                 entry->d_name);
+        if (sum_counter_files(path, net_names, values, 1) == 0) found = 1;
+    }
+    if (dir) closedir(dir);
+
+    snprintf(path, sizeof(path), "%s/infiniband", device);
+    dir = opendir(path);
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(ports, sizeof(ports), "%s/infiniband/%s/ports", device,
+                 entry->d_name);
+        port_dir = opendir(ports);
+        while (port_dir && (port = readdir(port_dir))) {
+            if (port->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/%s/counters", ports,
+                     port->d_name);
+            if (sum_counter_files(path, ib_names, values, 4) == 0) found = 1;
+        }
+        if (port_dir) closedir(port_dir);
+    }
+    if (dir) closedir(dir);
+
+out:
+    counters->rx_bytes   = values[0];
+    counters->tx_bytes   = values[1];
+    counters->rx_packets = values[2];
+    counters->tx_packets = values[3];
+
+    return (found ? 0 : -1);
+}
+
+/* Read the byte and packet counters of a cxi device from its telemetry
+ * directory into values, which are left alone on failure.  Each file holds "<count>@<seconds>.<nanoseconds>",
+ * and packets are counted per traffic class (hni_pkts_*_by_tc_<n>).
+ */
+static int read_cxi_telemetry(const char* dir, unsigned long long* values)
+{
+    static const char* const octet_names[]
+        = {"hni_rx_ok_octets", "hni_tx_ok_octets"};
+    static const char* const packet_names[]
+        = {"hni_pkts_recv_by_tc", "hni_pkts_sent_by_tc"};
+    char                     path[1536];
+    unsigned long long       counts[4] = {0};
+    int                      i;
+    int                      tc;
+
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, octet_names[i]);
+        if (read_telemetry_file(path, &counts[i]) < 0) return (-1);
+        for (tc = 0;; tc++) {
+            snprintf(path, sizeof(path), "%s/%s_%d", dir, packet_names[i],
+                     tc);
+            if (read_telemetry_file(path, &counts[i + 2]) < 0) break;
+        }
+        if (tc == 0) return (-1);
+    }
+    memcpy(values, counts, sizeof(counts));
+
+    return (0);
+}
+
+/* add the count in a cxi telemetry file to *value */
+static int read_telemetry_file(const char* path, unsigned long long* value)
+{
+    unsigned long long count;
+    FILE*              f;
+    int                ret;
+
+    f = fopen(path, "r");
+    if (!f) return (-1);
+    ret = fscanf(f, "%llu", &count);
+    fclose(f);
+    if (ret != 1) return (-1);
+    *value += count;
+
+    return (0);
+}
+
+/* add the four counters named in names (bytes scaled by scale) to values */
+static int sum_counter_files(const char*         dir,
+                             const char* const*  names,
+                             unsigned long long* values,
+                             int                 scale)
+{
+    char               path[1536];
+    unsigned long long value;
+    FILE*              f;
+    int                i;
+
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        f = fopen(path, "r");
+        if (!f) return (-1);
+        if (fscanf(f, "%llu", &value) != 1) value = 0;
+        fclose(f);
+        values[i] += i < 2 ? value * scale : value;
+    }
+
+    return (0);
+}
+
+/* per second change in a counter, treating a reset as no traffic */
+static double
+counter_rate(unsigned long long before, unsigned long long after, double secs)
+{
+    if (after < before || secs <= 0) return (0);
+
+    return ((after - before) / secs);
+}
+
+/* count the packages that have PUs this process may use */
 static int count_packages(hwloc_topology_t* topology)
 {
-    hwloc_obj_t obj = NULL;
-    hwloc_obj_t root;
+    hwloc_obj_t obj           = NULL;
     int         package_count = 0;
 
-    root = hwloc_get_root_obj(*topology);
-    do {
-        obj = hwloc_get_next_child(*topology, root, obj);
-        if (obj && obj->type == HWLOC_OBJ_PACKAGE) { package_count++; }
-    } while (obj);
+    while ((obj = hwloc_get_next_obj_by_type(*topology, HWLOC_OBJ_PACKAGE,
+                                             obj))) {
+        if (!hwloc_bitmap_iszero(obj->cpuset)) package_count++;
+    }
 
     return (package_count);
 }
+
+/* Summarize the trace files written by processes run with
+ * MOCHI_PLUMBER_TRACE: how each resolution was made, why addresses were
+ * passed through, and how many processes ended up on each NIC.
+ */
+static int summarize_trace(struct options* opts)
+{
+    struct trace_record* records     = NULL;
+    struct trace_tally*  sources     = NULL;
+    struct trace_tally*  reasons     = NULL;
+    struct trace_tally*  assignments = NULL;
+    struct trace_tally*  hosts       = NULL;
+    int                  num_sources = 0;
+    int                  num_reasons = 0;
+    int                  num_assigns = 0;
+    int                  num_hosts   = 0;
+    int                  num_files;
+    int                  num_records;
+    char                 host[128];
+    char                 value[128];
+    char                 key[320];
+    long                 ns;
+    FILE*                merged;
+    int                  ret = 0;
+    int                  i;
+
+    ret = read_trace_dir(opts->trace_dir, &num_files, &num_records, &records);
+    if (ret < 0) {
+        fprintf(stderr, "Error: unable to read traces in %s.\n",
+                opts->trace_dir);
+        return (-1);
+    }
+
+    /* records are still grouped by process here, which tally() relies on */
+    for (i = 0; i < num_records && ret == 0; i++) {
+        if (trace_field(records[i].line, "host", host, sizeof(host)) < 0)
+            strcpy(host, "?");
+        ns = 0;
+        if (trace_field(records[i].line, "total", value, sizeof(value)) == 0)
+            ns = atol(value);
+
+        ret |= tally(&hosts, &num_hosts, host, records[i].file, ns);
+        if (trace_field(records[i].line, "status", value, sizeof(value)) == 0
+            && strcmp(value, "0") != 0)
+            strcpy(value, "error");
+        else if (trace_field(records[i].line, "source", value, sizeof(value))
+                 < 0)
+            strcpy(value, "none");
+        ret |= tally(&sources, &num_sources, value, records[i].file, ns);
+
+        if (trace_field(records[i].line, "passthrough", value, sizeof(value))
+            == 0)
+            ret |= tally(&reasons, &num_reasons, value, records[i].file, ns);
+
+        if (trace_field(records[i].line, "nic", value, sizeof(value)) == 0) {
+            snprintf(key, sizeof(key), "%s %s", host, value);
+            ret |= tally(&assignments, &num_assigns, key, records[i].file, ns);
+        }
+    }
+
+    if (ret == 0) {
+        printf("Trace summary:\n");
+        printf("\t%d resolutions by %d processes on %d hosts\n", num_records,
+               num_files, num_hosts);
+        print_tallies("Resolutions by source", sources, num_sources);
+        print_tallies("Passthrough reasons", reasons, num_reasons);
+        print_tallies("NIC assignments (host and NIC)", assignments,
+                      num_assigns);
+    }
+
+    if (ret == 0 && strlen(opts->merge_file)) {
+        qsort(records, num_records, sizeof(*records), compare_records);
+        merged = fopen(opts->merge_file, "w");
+        if (!merged) {
+            perror("fopen");
+            ret = -1;
+        }
+        for (i = 0; merged && i < num_records; i++)
+            fprintf(merged, "%s\n", records[i].line);
+        if (merged) fclose(merged);
+    }
+
+    for (i = 0; i < num_records; i++) free(records[i].line);
+    free(records);
+    free(sources);
+    free(reasons);
+    free(assignments);
+    free(hosts);
+
+    return (ret);
+}
+
+/* read every record of every trace file in dir */
+static int read_trace_dir(const char*           dir,
+                          int*                  num_files,
+                          int*                  num_records,
+                          struct trace_record** records)
+{
+    DIR*                 d;
+    struct dirent*       entry;
+    struct trace_record* tmp;
+    char                 path[1024];
+    char                 value[64];
+    char*                line = NULL;
+    size_t               size = 0;
+    ssize_t              len;
+    FILE*                f;
+
+    *num_files   = 0;
+    *num_records = 0;
+    *records     = NULL;
+
+    d = opendir(dir);
+    if (!d) return (-1);
+
+    while ((entry = readdir(d))) {
+        if (strncmp(entry->d_name, "mochi-plumber-trace.", 20) != 0) continue;
+        len = strlen(entry->d_name);
+        if (len < 6 || strcmp(entry->d_name + len - 6, ".jsonl") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        f = fopen(path, "r");
+        if (!f) continue;
+
+        while ((len = getline(&line, &size, f)) > 0) {
+            if (line[len - 1] == '\n') line[len - 1] = '\0';
+            if (trace_field(line, "time", value, sizeof(value)) < 0) continue;
+            tmp = realloc(*records, (*num_records + 1) * sizeof(**records));
+            if (!tmp) break;
+            *records                      = tmp;
+            (*records)[*num_records].time = strtod(value, NULL);
+            (*records)[*num_records].file = *num_files;
+            (*records)[*num_records].line = strdup(line);
+            if (!(*records)[*num_records].line) break;
+            (*num_records)++;
+        }
+        fclose(f);
+        (*num_files)++;
+    }
+    free(line);
+    closedir(d);
+
+    return (0);
+}
+
+/* order records by time, keeping each process's records in order */
+static int compare_records(const void* a, const void* b)
+{
+    const struct trace_record* ra = a;
+    const struct trace_record* rb = b;
+
+    if (ra->time != rb->time) return (ra->time < rb->time ? -1 : 1);
+    if (ra->file != rb->file) return (ra->file - rb->file);
+    return (ra < rb ? -1 : 1);
+}
+
+/* Copy the value of "key" in a trace record into buf, without quotes for
+ * strings.  Returns -1 if the key is missing or its value is null.
+ */
+static int trace_field(const char* line,
+                       const char* key,
+                       char*       buf,
+                       size_t      size)
+{
+    char        pattern[64];
+    const char* p;
+    size_t      len = 0;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+    if (!p) return (-1);
+    p += strlen(pattern);
+    if (strncmp(p, "null", 4) == 0) return (-1);
+
+    if (*p == '"') {
+        for (p++; *p && *p != '"' && len + 1 < size; p++) {
+            if (*p == '\\' && p[1]) p++;
+            buf[len++] = *p;
+        }
+    } else {
+        for (; *p && *p != ',' && *p != '}' && len + 1 < size; p++)
+            buf[len++] = *p;
+    }
+    buf[len] = '\0';
+
+    return (0);
+}
+
+/* Count a resolution (taking ns) by a process under key.  A process's
+ * resolutions must be counted consecutively.
+ */
+static int tally(struct trace_tally** tallies,
+                 int*                 num_tallies,
+                 const char*          key,
+                 int                  file,
+                 long                 ns)
+{
+    struct trace_tally* tmp;
+    int                 i;
+
+    for (i = 0; i < *num_tallies; i++) {
+        if (strcmp((*tallies)[i].key, key) == 0) break;
+    }
+    if (i == *num_tallies) {
+        tmp = realloc(*tallies, (*num_tallies + 1) * sizeof(**tallies));
+        if (!tmp) return (-1);
+        *tallies = tmp;
+        memset(&tmp[i], 0, sizeof(tmp[i]));
+        snprintf(tmp[i].key, sizeof(tmp[i].key), "%s", key);
+        tmp[i].last_file = -1;
+        (*num_tallies)++;
+    }
+
+    (*tallies)[i].records++;
+    if ((*tallies)[i].last_file != file) (*tallies)[i].processes++;
+    (*tallies)[i].last_file = file;
+    (*tallies)[i].total_ns += ns;
+    if (ns > (*tallies)[i].max_ns) (*tallies)[i].max_ns = ns;
+
+    return (0);
+}
+
+static void print_tallies(const char*         title,
+                          struct trace_tally* tallies,
+                          int                 num_tallies)
+{
+    int i;
+
+    printf("\n%s:\n", title);
+    printf("\t#<key>\t<resolutions>\t<processes>\t<mean ns>\t<max ns>\n");
+    for (i = 0; i < num_tallies; i++) {
+        printf("\t%s\t%d\t%d\t%ld\t%ld\n", tallies[i].key,
+               tallies[i].records, tallies[i].processes,
+               tallies[i].total_ns / tallies[i].records, tallies[i].max_ns);
+    }
+}
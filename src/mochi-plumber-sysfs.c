@@ -0,0 +1,262 @@
+/**
+ * @file mochi-plumber-sysfs.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <hwloc.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber-internal.h"
+
+static int add_irq_vector(const char* irq, hwloc_bitmap_t** vectors, int* num);
+static int link_up(const char* path, int* found);
+
+int mochi_plumber_pci_cpuset(hwloc_topology_t topology,
+                             unsigned int     domain_id,
+                             unsigned int     bus_id,
+                             unsigned int     device_id,
+                             unsigned int     function_id,
+                             hwloc_bitmap_t   cpuset)
+{
+    char        path[256];
+    char        list[4096];
+    hwloc_obj_t numa;
+    FILE*       f;
+    int         node;
+    int         ret;
+
+    hwloc_bitmap_zero(cpuset);
+
+    /* the PUs that the kernel considers local to the device */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/%s",
+             domain_id, bus_id, device_id, function_id, "local_cpulist");
+    f = fopen(path, "r");
+    if (f) {
+        ret = fscanf(f, "%4095s", list);
+        fclose(f);
+        if (ret == 1 && hwloc_bitmap_list_sscanf(cpuset, list) == 0) {
+            hwloc_bitmap_and(cpuset, cpuset,
+                             hwloc_topology_get_allowed_cpuset(topology));
+            return (0);
+        }
+    }
+
+    /* otherwise the PUs of the NUMA node that it is attached to */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/%s",
+             domain_id, bus_id, device_id, function_id, "numa_node");
+    f = fopen(path, "r");
+    if (!f) return (-1);
+    ret = fscanf(f, "%d", &node);
+    fclose(f);
+    if (ret != 1 || node < 0) return (-1);
+
+    numa = hwloc_get_numanode_obj_by_os_index(topology, node);
+    if (numa) {
+        hwloc_bitmap_and(cpuset, numa->cpuset,
+                         hwloc_topology_get_allowed_cpuset(topology));
+        return (0);
+    }
+    /* a node outside of the cgroup is known, just not local to any PU that
+     * we may use
+     */
+    if (hwloc_bitmap_isset(hwloc_topology_get_complete_nodeset(topology), node))
+        return (0);
+
+    return (-1);
+}
+
+int mochi_plumber_irq_cpuset(unsigned int   domain_id,
+                             unsigned int   bus_id,
+                             unsigned int   device_id,
+                             unsigned int   function_id,
+                             hwloc_bitmap_t cpuset)
+{
+    hwloc_bitmap_t* vectors;
+    int             num;
+    int             i;
+
+    hwloc_bitmap_zero(cpuset);
+
+    num = mochi_plumber_irq_vectors(domain_id, bus_id, device_id, function_id,
+                                    &vectors);
+    if (num < 0) return (-1);
+    for (i = 0; i < num; i++) hwloc_bitmap_or(cpuset, cpuset, vectors[i]);
+    mochi_plumber_irq_vectors_free(vectors, num);
+
+    return (0);
+}
+
+int mochi_plumber_irq_vectors(unsigned int     domain_id,
+                              unsigned int     bus_id,
+                              unsigned int     device_id,
+                              unsigned int     function_id,
+                              hwloc_bitmap_t** vectors)
+{
+    char           path[256];
+    char           irq[32];
+    DIR*           dir;
+    struct dirent* entry;
+    FILE*          f;
+    int            num = 0;
+
+    *vectors = NULL;
+
+    /* every MSI/MSI-X vector of the device has its own affinity */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/%s",
+             domain_id, bus_id, device_id, function_id, "msi_irqs");
+    dir = opendir(path);
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        add_irq_vector(entry->d_name, vectors, &num);
+    }
+    if (dir) closedir(dir);
+    if (num > 0) return (num);
+
+    /* otherwise fall back to the legacy interrupt line, if any */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/%s",
+             domain_id, bus_id, device_id, function_id, "irq");
+    f = fopen(path, "r");
+    if (!f) return (-1);
+    if (fscanf(f, "%31s", irq) != 1) {
+        fclose(f);
+        return (-1);
+    }
+    fclose(f);
+    if (strcmp(irq, "0") == 0) return (-1);
+
+    add_irq_vector(irq, vectors, &num);
+    return (num > 0 ? num : -1);
+}
+
+void mochi_plumber_irq_vectors_free(hwloc_bitmap_t* vectors, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) hwloc_bitmap_free(vectors[i]);
+    free(vectors);
+}
+
+/* Append the CPUs that an interrupt is delivered to.  The effective
+ * affinity (what the interrupt controller actually targets, usually a
+ * single CPU) is used where the kernel reports it; the requested affinity
+ * is often every CPU.
+ */
+static int add_irq_vector(const char* irq, hwloc_bitmap_t** vectors, int* num)
+{
+    static const char* files[]
+        = {"effective_affinity_list", "smp_affinity_list"};
+    char               path[256];
+    char               list[4096];
+    hwloc_bitmap_t     cpuset;
+    hwloc_bitmap_t*    grown;
+    FILE*              f = NULL;
+    size_t             i;
+    int                ret;
+
+    for (i = 0; !f && i < sizeof(files) / sizeof(files[0]); i++) {
+        snprintf(path, sizeof(path), "/proc/irq/%s/%s", irq, files[i]);
+        f = fopen(path, "r");
+    }
+    if (!f) return (-1);
+    ret = fscanf(f, "%4095s", list);
+    fclose(f);
+    if (ret != 1) return (-1);
+
+    cpuset = hwloc_bitmap_alloc();
+    if (!cpuset) return (-1);
+    grown = realloc(*vectors, (*num + 1) * sizeof(*grown));
+    if (!grown || hwloc_bitmap_list_sscanf(cpuset, list) < 0) {
+        if (grown) *vectors = grown;
+        hwloc_bitmap_free(cpuset);
+        return (-1);
+    }
+    *vectors         = grown;
+    (*vectors)[*num] = cpuset;
+    (*num)++;
+
+    return (0);
+}
+
+int mochi_plumber_link_state(unsigned int domain_id,
+                             unsigned int bus_id,
+                             unsigned int device_id,
+                             unsigned int function_id)
+{
+    char           dev[64];
+    char           path[1024];
+    DIR*           dir;
+    DIR*           ports;
+    struct dirent* entry;
+    struct dirent* port;
+    int            found = 0;
+    int            up    = 0;
+
+    snprintf(dev, sizeof(dev), "/sys/bus/pci/devices/%04x:%02x:%02x.%x",
+             domain_id, bus_id, device_id, function_id);
+
+    /* network interfaces of the device (including those of cxi NICs) */
+    snprintf(path, sizeof(path), "%s/net", dev);
+    dir = opendir(path);
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/net/%s/operstate", dev,
+                 entry->d_name);
+        up |= link_up(path, &found);
+    }
+    if (dir) closedir(dir);
+
+    /* ports of InfiniBand (verbs) devices, e.g. "4: ACTIVE" */
+    snprintf(path, sizeof(path), "%s/infiniband", dev);
+    dir = opendir(path);
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/infiniband/%s/ports", dev,
+                 entry->d_name);
+        ports = opendir(path);
+        while (ports && (port = readdir(ports))) {
+            if (port->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/infiniband/%s/ports/%s/state",
+                     dev, entry->d_name, port->d_name);
+            up |= link_up(path, &found);
+        }
+        if (ports) closedir(ports);
+    }
+    if (dir) closedir(dir);
+
+    if (!found) return (-1);
+    return (up);
+}
+
+/* Whether a sysfs state file reports a usable link: "up" (or "unknown",
+ * from drivers that don't track it) for an interface, and "ACTIVE" (as in
+ * "4: ACTIVE") for an InfiniBand port.
+ */
+static int link_up(const char* path, int* found)
+{
+    char  state[64];
+    char* word;
+    FILE* f;
+
+    f = fopen(path, "r");
+    if (!f) return (0);
+    if (!fgets(state, sizeof(state), f)) {
+        fclose(f);
+        return (0);
+    }
+    fclose(f);
+    *found = 1;
+
+    state[strcspn(state, "\n")] = '\0';
+    word                         = strrchr(state, ' ');
+    word                         = word ? word + 1 : state;
+
+    return (strcmp(word, "up") == 0 || strcmp(word, "unknown") == 0
+            || strcmp(word, "ACTIVE") == 0);
+}
@@ -0,0 +1,167 @@
+/**
+ * @file mochi-plumber-trace.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber-internal.h"
+
+/* Names of the phases of a resolution, in the order they happen.  These
+ * become JSON keys, and mochi-plumber-query reads them back.
+ */
+const char* const mochi_plumber_trace_phases[MOCHI_PLUMBER_TRACE_PHASES]
+    = {"prepare", "memo", "broker", "topology", "table", "select"};
+
+/* The trace file is opened on first use.  Callers of
+ * mochi_plumber_trace_write() serialize access to these.
+ */
+static int   trace_enabled = 0; /* 0 unknown, 1 yes, -1 no */
+static FILE* trace_file    = NULL;
+static pid_t trace_pid     = -1;
+static char  trace_host[256];
+
+static int trace_open(void);
+
+int mochi_plumber_trace_enabled(void)
+{
+    const char* env;
+
+    if (trace_enabled == 0) {
+        env           = getenv("MOCHI_PLUMBER_TRACE");
+        trace_enabled = (env && strlen(env)) ? 1 : -1;
+    }
+
+    return (trace_enabled > 0);
+}
+
+long mochi_plumber_trace_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
+
+void mochi_plumber_trace_write(const struct mochi_plumber_trace* trace)
+{
+    struct timespec ts;
+    cpu_set_t       set;
+    long            total = 0;
+    int             first;
+    int             sep = 0;
+    int             i;
+
+    if (trace_open() < 0) return;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fprintf(trace_file, "{\"time\":%ld.%09ld,\"host\":", (long)ts.tv_sec,
+            ts.tv_nsec);
+    mochi_plumber_json_string(trace_file, trace_host);
+    fprintf(trace_file, ",\"pid\":%d,\"status\":%d,\"address\":",
+            (int)trace_pid, trace->status);
+    mochi_plumber_json_string(trace_file, trace->in_address);
+    fprintf(trace_file, ",\"bucket_policy\":");
+    mochi_plumber_json_string(trace_file, trace->bucket_policy);
+    fprintf(trace_file, ",\"nic_policy\":");
+    mochi_plumber_json_string(trace_file, trace->nic_policy);
+
+    /* where the calling thread is now, and where it may run */
+    fprintf(trace_file, ",\"cpu\":%d,\"cpuset\":\"", sched_getcpu());
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &set)) continue;
+            first = i;
+            while (i + 1 < CPU_SETSIZE && CPU_ISSET(i + 1, &set)) i++;
+            fprintf(trace_file, "%s%d", sep++ ? "," : "", first);
+            if (i != first) fprintf(trace_file, "-%d", i);
+        }
+    }
+    fprintf(trace_file, "\"");
+
+    fprintf(trace_file, ",\"source\":");
+    mochi_plumber_json_string(trace_file, trace->source);
+    fprintf(trace_file, ",\"passthrough\":");
+    mochi_plumber_json_string(trace_file, trace->passthrough);
+    fprintf(trace_file, ",\"bucket\":%d,\"bucket_nics\":[", trace->bucket);
+    for (i = 0; i < trace->num_nics; i++) {
+        if (i) fprintf(trace_file, ",");
+        mochi_plumber_json_string(trace_file, trace->nics[i]);
+    }
+    fprintf(trace_file, "],\"nic\":");
+    mochi_plumber_json_string(trace_file, trace->nic);
+    fprintf(trace_file, ",\"result\":");
+    mochi_plumber_json_string(trace_file, trace->address);
+
+    fprintf(trace_file, ",\"ns\":{");
+    for (i = 0; i < MOCHI_PLUMBER_TRACE_PHASES; i++) {
+        fprintf(trace_file, "\"%s\":%ld,", mochi_plumber_trace_phases[i],
+                trace->phase_ns[i]);
+        total += trace->phase_ns[i];
+    }
+    fprintf(trace_file, "\"total\":%ld}}\n", total);
+    fflush(trace_file);
+}
+
+/* open <dir>/mochi-plumber-trace.<host>.<pid>.jsonl, again after a fork */
+static int trace_open(void)
+{
+    const char* dir = getenv("MOCHI_PLUMBER_TRACE");
+    char        path[1024];
+
+    if (trace_file && trace_pid == getpid()) return (0);
+    if (trace_file) fclose(trace_file);
+    trace_file = NULL;
+    trace_pid  = getpid();
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        fprintf(stderr, "Error: failed to create %s\n", dir);
+        trace_enabled = -1;
+        return (-1);
+    }
+    gethostname(trace_host, sizeof(trace_host) - 1);
+    snprintf(path, sizeof(path), "%s/mochi-plumber-trace.%s.%d.jsonl", dir,
+             trace_host, (int)trace_pid);
+
+    trace_file = fopen(path, "a");
+    if (!trace_file) {
+        perror("fopen");
+        fprintf(stderr, "Error: failed to open %s\n", path);
+        trace_enabled = -1;
+        return (-1);
+    }
+
+    return (0);
+}
+
+void mochi_plumber_json_string(FILE* f, const char* str)
+{
+    if (!str) {
+        fprintf(f, "null");
+        return;
+    }
+
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(f, "\\u%04x", *str);
+        else
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
@@ -0,0 +1,317 @@
+/**
+ * @file mochi-plumber-watch.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "mochi-plumber-private.h"
+#include "mochi-plumber.h"
+#include "mochi-plumber-internal.h"
+
+/* default seconds between rescans, if MOCHI_PLUMBER_WATCH_INTERVAL is not
+ * set
+ */
+#define WATCH_INTERVAL 10
+
+/* milliseconds to let a device settle after a uevent before rescanning */
+#define WATCH_SETTLE 1000
+
+struct mochi_plumber_watch {
+    char                   in_address[MOCHI_PLUMBER_ADDR_MAX];
+    char                   bucket_policy[64];
+    char                   nic_policy[64];
+    char                   address[MOCHI_PLUMBER_ADDR_MAX]; /* last reported */
+    char                   nic[MOCHI_PLUMBER_NIC_MAX];      /* its NIC */
+    char*                  fingerprint;
+    mochi_plumber_watch_fn cb;
+    void*                  arg;
+    int                    interval; /* ms */
+    int                    uevent_fd;
+    int                    stop_fd[2];
+    pthread_t              thread;
+};
+
+static void* watch_thread(void* arg);
+static int   uevent_open(void);
+static int   uevent_relevant(int fd);
+static void  watch_rescan(struct mochi_plumber_watch* watch);
+static int   nic_usable(const char* fingerprint, const char* nic);
+static long  now_ms(void);
+static void  watch_free(struct mochi_plumber_watch* watch);
+
+int mochi_plumber_watch_start(const char*            in_address,
+                              const char*            bucket_policy,
+                              const char*            nic_policy,
+                              mochi_plumber_watch_fn cb,
+                              void*                  arg,
+                              mochi_plumber_watch_t* watch_out)
+{
+    struct mochi_plumber_watch* watch;
+    const char*                 env;
+    cpu_set_t                   set;
+    pthread_attr_t              attr;
+    int                         ret;
+
+    watch = calloc(1, sizeof(*watch));
+    if (!watch) return (-1);
+    watch->uevent_fd  = -1;
+    watch->stop_fd[0] = -1;
+    watch->stop_fd[1] = -1;
+    watch->cb         = cb;
+    watch->arg        = arg;
+
+    if (snprintf(watch->in_address, sizeof(watch->in_address), "%s",
+                 in_address)
+            >= (int)sizeof(watch->in_address)
+        || snprintf(watch->bucket_policy, sizeof(watch->bucket_policy), "%s",
+                    bucket_policy)
+               >= (int)sizeof(watch->bucket_policy)
+        || snprintf(watch->nic_policy, sizeof(watch->nic_policy), "%s",
+                    nic_policy)
+               >= (int)sizeof(watch->nic_policy)) {
+        fprintf(stderr, "Error: address or policy too long to watch.\n");
+        goto error;
+    }
+
+    env             = getenv("MOCHI_PLUMBER_WATCH_INTERVAL");
+    watch->interval = (env && atoi(env) > 0 ? atoi(env) : WATCH_INTERVAL)
+                    * 1000;
+
+    /* the baseline is what the caller has (most likely) already been given */
+    ret = mochi_plumber_resolve_nic_named(
+        in_address, bucket_policy, nic_policy, watch->address,
+        sizeof(watch->address), watch->nic, sizeof(watch->nic));
+    if (ret != 0) goto error;
+    watch->fingerprint = mochi_plumber_nic_fingerprint();
+    if (!watch->fingerprint) goto error;
+
+    if (pipe2(watch->stop_fd, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        goto error;
+    }
+    /* without uevents (e.g., in a restricted container) we still rescan
+     * periodically
+     */
+    watch->uevent_fd = uevent_open();
+
+    /* the watch thread shares the caller's binding, so that it resolves
+     * (through the broker, if there is one) on the caller's behalf
+     */
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_getaffinity");
+        goto error;
+    }
+    pthread_attr_init(&attr);
+    ret = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    if (ret == 0)
+        ret = pthread_create(&watch->thread, &attr, watch_thread, watch);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        fprintf(stderr, "Error: pthread_create() failure.\n");
+        goto error;
+    }
+
+    *watch_out = watch;
+    return (0);
+
+error:
+    watch_free(watch);
+    return (-1);
+}
+
+void mochi_plumber_watch_stop(mochi_plumber_watch_t watch)
+{
+    if (!watch) return;
+
+    if (write(watch->stop_fd[1], "x", 1) != 1) perror("write");
+    pthread_join(watch->thread, NULL);
+    watch_free(watch);
+}
+
+static void watch_free(struct mochi_plumber_watch* watch)
+{
+    if (watch->uevent_fd >= 0) close(watch->uevent_fd);
+    if (watch->stop_fd[0] >= 0) close(watch->stop_fd[0]);
+    if (watch->stop_fd[1] >= 0) close(watch->stop_fd[1]);
+    free(watch->fingerprint);
+    free(watch);
+}
+
+static void* watch_thread(void* arg)
+{
+    struct mochi_plumber_watch* watch = arg;
+    struct pollfd               fds[2];
+    int                         nfds = 1;
+    long                        next;
+    long                        now;
+    int                         ret;
+
+    fds[0].fd     = watch->stop_fd[0];
+    fds[0].events = POLLIN;
+    if (watch->uevent_fd >= 0) {
+        fds[1].fd     = watch->uevent_fd;
+        fds[1].events = POLLIN;
+        nfds          = 2;
+    }
+
+    next = now_ms() + watch->interval;
+    while (1) {
+        now = now_ms();
+        ret = poll(fds, nfds, next > now ? next - now : 0);
+        if (ret < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ret > 0 && fds[0].revents) break;
+
+        /* rescan soon after a NIC comes, goes, or changes state */
+        now = now_ms();
+        if (ret > 0 && nfds > 1 && (fds[1].revents & POLLIN)
+            && uevent_relevant(watch->uevent_fd)
+            && next > now + WATCH_SETTLE)
+            next = now + WATCH_SETTLE;
+
+        if (now >= next) {
+            watch_rescan(watch);
+            next = now_ms() + watch->interval;
+        }
+    }
+
+    return (NULL);
+}
+
+/* Re-resolve if the NICs or their links have changed, and report a new
+ * address.  The NIC last reported is kept for as long as it is present
+ * with a usable link, so that a change elsewhere doesn't move endpoints
+ * (or advance the roundrobin counters) for nothing.
+ */
+static void watch_rescan(struct mochi_plumber_watch* watch)
+{
+    char  address[MOCHI_PLUMBER_ADDR_MAX];
+    char  nic[MOCHI_PLUMBER_NIC_MAX];
+    char* scan;
+    int   ret;
+
+    scan = mochi_plumber_nic_fingerprint();
+    if (!scan) return;
+    if (strcmp(scan, watch->fingerprint) == 0) {
+        free(scan);
+        return;
+    }
+    free(watch->fingerprint);
+    watch->fingerprint = scan;
+
+    /* the cached state (and with it the process's earlier results) is only
+     * dropped when the NIC is actually being replaced
+     */
+    if (nic_usable(watch->fingerprint, watch->nic)) return;
+    mochi_plumber_invalidate();
+
+    ret = mochi_plumber_resolve_nic_named(
+        watch->in_address, watch->bucket_policy, watch->nic_policy, address,
+        sizeof(address), nic, sizeof(nic));
+    if (ret != 0 || strcmp(address, watch->address) == 0) return;
+
+    strcpy(watch->address, address);
+    strcpy(watch->nic, nic);
+    watch->cb(watch->address, watch->arg);
+}
+
+/* whether a fingerprint lists nic with a link that isn't known to be down */
+static int nic_usable(const char* fingerprint, const char* nic)
+{
+    const char* entry;
+    const char* end;
+    const char* state;
+    size_t      len = strlen(nic);
+
+    /* a passthrough result has no NIC to keep */
+    if (len == 0) return (0);
+
+    /* entries are "<provider>:<name>@<PCI address>=<state>;" */
+    for (entry = fingerprint; (entry = strchr(entry, ':')); entry = end) {
+        entry++;
+        end = strchr(entry, ';');
+        if (!end) break;
+        if (strncmp(entry, nic, len) == 0 && entry[len] == '@') {
+            state = strchr(entry, '=');
+            return (state && strncmp(state + 1, "down;", 5) != 0);
+        }
+    }
+
+    return (0);
+}
+
+/* subscribe to kernel device events; returns -1 if that is not permitted */
+static int uevent_open(void)
+{
+    struct sockaddr_nl addr;
+    int                fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return (-1);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel events */
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+/* Drain pending uevents, returning 1 if any of them concern a network
+ * device.  Each event is "<action>@<devpath>" followed by KEY=value
+ * strings, all NUL separated.
+ */
+static int uevent_relevant(int fd)
+{
+    static const char* subsystems[]
+        = {"SUBSYSTEM=net", "SUBSYSTEM=infiniband", "SUBSYSTEM=pci",
+           "SUBSYSTEM=cxi"};
+    char    buf[8192];
+    ssize_t len;
+    size_t  off;
+    size_t  i;
+    int     relevant = 0;
+
+    while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[len] = '\0';
+        for (off = 0; off < (size_t)len; off += strlen(buf + off) + 1) {
+            for (i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++) {
+                if (strncmp(buf + off, subsystems[i], strlen(subsystems[i]))
+                    == 0)
+                    relevant = 1;
+            }
+        }
+    }
+
+    return (relevant);
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
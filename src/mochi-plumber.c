@@ -6,251 +6,1476 @@
  * See COPYRIGHT in top-level directory.
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
 #include <hwloc.h>
 
 #include "mochi-plumber-private.h"
+#include "mochi-plumber.h"
+#include "mochi-plumber-internal.h"
+
+/* NICs measured within this fraction of the fastest NIC from a NUMA domain
+ * are considered local to it by the "measured" bucket policy
+ */
+#define MEASURED_TOLERANCE 0.10
+
+/* appended to a bucket policy to choose the bucket by overlap with the
+ * process's CPU and memory binding rather than the PU it last ran on
+ */
+#define OVERLAP_SUFFIX "+overlap"
+
+/* memory regions are spread across the NICs of a bucket in units of this
+ * size (a huge page)
+ */
+#define REGION_SPAN (2UL << 20)
+
+/* number of distinct resolutions remembered per process */
+#define MEMO_ENTRIES 16
+
+/* A Mercury protocol that we know how to select NICs for, and the
+ * libfabric provider that reports its NICs.  Addresses that name verbs or
+ * tcp on their own are passed through; NICs are only selected for those
+ * when the protocol was chosen from "auto" or a list of preferences.
+ */
+struct transport {
+    const char* name;      /* e.g., "ofi+cxi" */
+    const char* alias;     /* accepted shorthand, or NULL */
+    const char* prov_name; /* libfabric provider */
+    uint32_t    protocol;  /* libfabric endpoint protocol, or 0 for any */
+    int         named;     /* select NICs when named rather than chosen */
+    int         needs_nic; /* only usable with a local PCI NIC */
+};
+
+/* in order of preference when the transport is selected automatically */
+static const struct transport transports[] = {
+    {"ofi+cxi", "cxi", "cxi", FI_PROTO_CXI, 1, 1},
+    {"ofi+verbs", NULL, "verbs", 0, 0, 1},
+    {"ofi+tcp", NULL, "tcp", 0, 0, 0},
+};
+#define NUM_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+/* the interrupt vectors of a NIC, with the PUs each is delivered to */
+struct nic_irqs {
+    int             num_vectors; /* 0 if unknown */
+    hwloc_bitmap_t* vectors;
+};
 
 struct bucket {
-    int    num_nics;
-    char** nics;
+    int                     num_nics;
+    char**                  nics;
+    const struct nic_irqs** irqs;   /* interrupts of each NIC */
+    hwloc_const_cpuset_t    cpuset; /* PUs served by this bucket */
+};
+
+/* NICs divided into buckets according to a particular bucket policy.  The
+ * bucket array, the per-bucket NIC and interrupt arrays, and the NIC names
+ * all live in a single allocation starting at buckets.
+ */
+struct bucket_table {
+    const struct transport* transport;
+    char*                   bucket_policy;
+    int                     nbuckets;
+    struct bucket*          buckets;
+    int                     num_nics;
+    struct nic_irqs*        nic_irqs; /* referenced by the buckets' irqs */
+    int                     usable; /* every bucket has at least one NIC */
+    struct bucket_table*    next;
+};
+
+/* Everything mochi_plumber_resolve_nic_for_region() needs to map a region
+ * to a NIC, for one address and bucket policy.  Maps are built under the
+ * cache mutex and then published for lock-free lookup; they are
+ * self-contained (NIC names are copied in) and are never freed, since a
+ * reader may still be using one after it has been retired.
+ */
+struct region_map {
+    char               in_address[MOCHI_PLUMBER_ADDR_MAX];
+    char               bucket_policy[64];
+    char               address[MOCHI_PLUMBER_ADDR_MAX]; /* to format from */
+    int                nbuckets; /* 0 to pass the address through */
+    int*               first;    /* nbuckets + 1 offsets into nics */
+    char**             nics;
+    int                num_nodes;
+    int*               node_bucket; /* by NUMA node OS index, or -1 */
+    int                num_cpus;
+    int*               cpu_bucket; /* by PU OS index, or -1 */
+    uintptr_t          page_mask;
+    struct region_map* next;    /* published maps */
+    struct region_map* retired; /* maps retired by invalidation */
 };
 
-static int select_nic(hwloc_topology_t* topology,
-                      const char*       bucket_policy,
-                      const char*       nic_policy,
-                      int               nbuckets,
-                      struct bucket*    buckets,
-                      const char**      out_nic);
-static int select_nic_roundrobin(int            bucket_idx,
-                                 struct bucket* bucket,
-                                 const char**   out_nic);
-static int
-select_nic_random(int bucket_idx, struct bucket* bucket, const char** out_nic);
-static int  select_nic_bycore(hwloc_topology_t* topology,
-                              int               bucket_idx,
-                              struct bucket*    bucket,
-                              const char**      out_nic);
-static int  select_nic_byset(hwloc_topology_t* topology,
-                             int               bucket_idx,
-                             struct bucket*    bucket,
-                             const char**      out_nic);
-static int  count_packages(hwloc_topology_t* topology);
-static int  setup_buckets(hwloc_topology_t* topology,
-                          const char*       bucket_policy,
-                          int*              nbuckets,
-                          struct bucket**   buckets);
-static void release_buckets(int nbuckets, struct bucket* buckets);
+/* A previous resolution and the CPU binding of the thread that made it */
+struct memo_entry {
+    int       valid;
+    char      in_address[MOCHI_PLUMBER_ADDR_MAX];
+    char      bucket_policy[64];
+    char      nic_policy[64];
+    cpu_set_t cpuset;
+    long long stamp; /* job registry at the time, if partitioning */
+    int       passthrough;
+    char      nic[MOCHI_PLUMBER_NIC_MAX];
+};
+
+/* Process-wide state that is retained across resolution calls so that the
+ * topology is only loaded, and each bucket table only built, once.  The
+ * scratch bitmaps are used while selecting a NIC so that a warm resolution
+ * does not need to allocate anything.  Everything here is protected by the
+ * mutex.
+ */
+static struct {
+    pthread_mutex_t      mutex;
+    int                  topology_loaded;
+    hwloc_topology_t     topology;
+    hwloc_bitmap_t       cpuset;  /* PU the calling thread last ran on */
+    hwloc_bitmap_t       bound;   /* PUs the calling process is bound to */
+    hwloc_bitmap_t       scratch;
+    hwloc_bitmap_t       anchor;  /* PU that NICs are chosen relative to */
+    hwloc_bitmap_t       membind; /* NUMA nodes bound for process memory */
+    char                 mems[256]; /* membind as a list, for the broker */
+    char                 cpus[2048]; /* bound as a list, for the broker */
+    struct bucket_table* tables;
+    char                 broker_nic[MOCHI_PLUMBER_NIC_MAX];
+    int                  available[NUM_TRANSPORTS]; /* 0 unknown, 1, or -1 */
+    char                 address[MOCHI_PLUMBER_ADDR_MAX]; /* auto transport */
+    int                  memo_enabled; /* 0 unknown, 1 yes, -1 no */
+    int                  partition;    /* 0 unknown, 1 yes, -1 no */
+    int                  memo_next;    /* entry to replace next */
+    cpu_set_t            memo_cpuset;
+    long long            memo_stamp;
+    struct memo_entry    memo[MEMO_ENTRIES];
+    int                  tracing;    /* tracing the current resolution */
+    long                 trace_mark; /* end of the last traced phase */
+    struct region_map*   retired;    /* no longer published */
+    int                  measured_failed; /* the affinity table is unusable */
+    struct timespec      measured_mtime;  /* of the table when last checked */
+} cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/* region maps, read without the mutex and only added to (atomically) while
+ * holding it
+ */
+static struct region_map* regions = NULL;
+
+/* the resolution being traced, if any; protected by cache.mutex */
+static struct mochi_plumber_trace trace;
+
+static void trace_begin(const char* in_address,
+                        const char* bucket_policy,
+                        const char* nic_policy);
+static void trace_phase(enum mochi_plumber_trace_phase phase);
+static void trace_end(int status, const char* address, const char* nic);
+static int  resolve_nic_locked(const char*  in_address,
+                               const char*  bucket_policy,
+                               const char*  nic_policy,
+                               const char** out_address,
+                               const char** out_nic);
+static struct region_map* region_map_find(const char* in_address,
+                                          const char* bucket_policy);
+static struct region_map* region_map_build(const char* in_address,
+                                           const char* bucket_policy);
+static int region_map_equal(const struct region_map* a,
+                            const struct region_map* b);
+static int region_bucket(const struct region_map* map,
+                         const void*              region,
+                         size_t                   region_len);
+static int  prepare_address(const char*              in_address,
+                            const char*              bucket_policy,
+                            const char*              nic_policy,
+                            const char**             out_address,
+                            const struct transport** out_transport);
+static int  resolve_nic_uncached(const struct transport* transport,
+                                 const char*             bucket_policy,
+                                 const char*             nic_policy,
+                                 const char**            out_nic);
+static const struct transport* find_transport(const char* protocol,
+                                              size_t      len);
+static int  select_transport(const char* in_address, char* buf, size_t size);
+static int  transport_available(const struct transport* transport);
+static int  transport_getinfo(const struct transport* transport,
+                              struct fi_info**        info);
+static int  is_local_nic(struct fi_info* info, struct fi_info* cur);
+static struct memo_entry* memo_lookup(const char* in_address,
+                                      const char* bucket_policy,
+                                      const char* nic_policy);
+static void memo_store(const char* in_address,
+                       const char* bucket_policy,
+                       const char* nic_policy,
+                       const char* nic);
+static int  load_topology(void);
+static struct bucket_table*
+get_bucket_table(const struct transport* transport, const char* bucket_policy);
+static void free_bucket_table(struct bucket_table* table);
+static size_t bucket_policy_base(const char* bucket_policy, int* overlap);
+static int    job_partition_enabled(void);
+static int  overlap_bucket(int                  nbuckets,
+                           struct bucket*       buckets,
+                           hwloc_const_cpuset_t cpuset,
+                           hwloc_const_cpuset_t memcpus);
+static int  select_nic(hwloc_topology_t*     topology,
+                       const char*           bucket_policy,
+                       const char*           nic_policy,
+                       int                   nbuckets,
+                       struct bucket*        buckets,
+                       hwloc_const_cpuset_t  last_cpu,
+                       hwloc_const_cpuset_t  cpuset,
+                       hwloc_const_nodeset_t membind,
+                       mochi_plumber_pick_fn pick,
+                       void*                 pick_arg,
+                       const char**          out_nic);
+static int  select_nic_roundrobin(int                   bucket_idx,
+                                  struct bucket*        bucket,
+                                  mochi_plumber_pick_fn pick,
+                                  void*                 pick_arg,
+                                  const char**          out_nic);
+static int  select_nic_random(int                   bucket_idx,
+                              struct bucket*        bucket,
+                              mochi_plumber_pick_fn pick,
+                              void*                 pick_arg,
+                              const char**          out_nic);
+static int  select_nic_bycore(hwloc_topology_t*    topology,
+                              int                  bucket_idx,
+                              struct bucket*       bucket,
+                              hwloc_const_cpuset_t last_cpu,
+                              const char**         out_nic);
+static int  select_nic_byset(hwloc_topology_t*    topology,
+                             int                  bucket_idx,
+                             struct bucket*       bucket,
+                             hwloc_const_cpuset_t cpuset,
+                             const char**         out_nic);
+static int  select_nic_irq(hwloc_topology_t*    topology,
+                           int                  bucket_idx,
+                           struct bucket*       bucket,
+                           hwloc_const_cpuset_t last_cpu,
+                           const char**         out_nic);
+static int  bucket_nic_index(hwloc_topology_t* topology,
+                             struct bucket*    bucket,
+                             int               pu_os_index);
+static int  numa_is_bucket(hwloc_topology_t* topology, hwloc_obj_t numa);
+static int  get_bucket_objs(hwloc_topology_t* topology,
+                            const char*       bucket_policy,
+                            int*              depth,
+                            int*              nbuckets,
+                            hwloc_obj_t**     bucket_objs);
+static int  bucket_policy_depth(hwloc_topology_t* topology,
+                                const char*       bucket_policy,
+                                int*              depth);
+static int  measured_failed(void);
+static int  assign_measured_buckets(int             nbuckets,
+                                    hwloc_obj_t*    bucket_objs,
+                                    int             num_nics,
+                                    char**          nic_names,
+                                    hwloc_bitmap_t* nic_buckets);
+static int  setup_buckets(hwloc_topology_t*       topology,
+                          const struct transport* transport,
+                          const char*             bucket_policy,
+                          int*                    nbuckets,
+                          struct bucket**         buckets,
+                          int*                    num_irqs,
+                          struct nic_irqs**       nic_irqs);
+
+/* Write the canonical form of in_address followed by nic (if any) into
+ * buf.  If there is no :// present in the address string, then the string
+ * must just be an na identifier for Mercury and we append a "://" to it.
+ * Returns the length of the full string, like snprintf().
+ */
+static size_t format_address(const char* in_address,
+                             const char* nic,
+                             char*       buf,
+                             size_t      buf_size)
+{
+    return (snprintf(buf, buf_size, "%s%s%s", in_address,
+                     strstr(in_address, "://") ? "" : "://", nic ? nic : ""));
+}
+
+int mochi_plumber_resolve_nic(const char* in_address,
+                              const char* bucket_policy,
+                              const char* nic_policy,
+                              char**      out_address)
+{
+    int         ret;
+    size_t      len;
+    const char* address;
+    const char* selected_nic = NULL;
+
+    pthread_mutex_lock(&cache.mutex);
+    trace_begin(in_address, bucket_policy, nic_policy);
+    ret = resolve_nic_locked(in_address, bucket_policy, nic_policy, &address,
+                             &selected_nic);
+    if (ret == 0) {
+        len          = format_address(address, selected_nic, NULL, 0) + 1;
+        *out_address = malloc(len);
+        if (*out_address)
+            format_address(address, selected_nic, *out_address, len);
+        else
+            ret = -1;
+    }
+    trace_end(ret, ret == 0 ? *out_address : NULL, selected_nic);
+    pthread_mutex_unlock(&cache.mutex);
+
+    return (ret);
+}
+
+int mochi_plumber_resolve_nic_buf(const char* in_address,
+                                  const char* bucket_policy,
+                                  const char* nic_policy,
+                                  char*       out_address,
+                                  size_t      out_size)
+{
+    return (mochi_plumber_resolve_nic_named(in_address, bucket_policy,
+                                            nic_policy, out_address, out_size,
+                                            NULL, 0));
+}
+
+int mochi_plumber_resolve_nic_named(const char* in_address,
+                                    const char* bucket_policy,
+                                    const char* nic_policy,
+                                    char*       out_address,
+                                    size_t      out_size,
+                                    char*       out_nic,
+                                    size_t      nic_size)
+{
+    int         ret;
+    size_t      len;
+    const char* address;
+    const char* selected_nic = NULL;
+
+    pthread_mutex_lock(&cache.mutex);
+    trace_begin(in_address, bucket_policy, nic_policy);
+    ret = resolve_nic_locked(in_address, bucket_policy, nic_policy, &address,
+                             &selected_nic);
+    if (ret == 0) {
+        len = format_address(address, selected_nic, out_address, out_size);
+        /* report the required size if the caller's buffer is too small */
+        if (len >= out_size) ret = len + 1;
+    }
+    if (ret == 0 && out_nic)
+        snprintf(out_nic, nic_size, "%s", selected_nic ? selected_nic : "");
+    trace_end(ret, ret == 0 ? out_address : NULL, selected_nic);
+    pthread_mutex_unlock(&cache.mutex);
+
+    return (ret);
+}
+
+int mochi_plumber_resolve_nic_for_region(const char* in_address,
+                                         const char* bucket_policy,
+                                         const void* region,
+                                         size_t      region_len,
+                                         char*       out_address,
+                                         size_t      out_size)
+{
+    struct region_map* map;
+    const char*        selected_nic = NULL;
+    int                bucket_idx;
+    int                num_nics;
+    uint64_t           hash;
+    size_t             len;
+
+    if (!region || region_len == 0) {
+        fprintf(stderr, "Error: empty memory region.\n");
+        return (-1);
+    }
+
+    /* only the first call for an address and policy takes the mutex */
+    map = region_map_find(in_address, bucket_policy);
+    if (!map) {
+        pthread_mutex_lock(&cache.mutex);
+        map = region_map_find(in_address, bucket_policy);
+        if (!map) map = region_map_build(in_address, bucket_policy);
+        pthread_mutex_unlock(&cache.mutex);
+        if (!map) return (-1);
+    }
+
+    if (map->nbuckets) {
+        bucket_idx = region_bucket(map, region, region_len);
+        if (bucket_idx < 0) {
+            fprintf(stderr, "Error: no %s bucket serves the memory region.\n",
+                    bucket_policy);
+            return (-1);
+        }
+
+        /* Fibonacci hashing of REGION_SPAN-sized chunks of the address
+         * space, so that regularly strided buffers still spread
+         */
+        num_nics = map->first[bucket_idx + 1] - map->first[bucket_idx];
+        hash     = (uintptr_t)region / REGION_SPAN;
+        hash *= 0x9e3779b97f4a7c15ULL;
+        selected_nic
+            = map->nics[map->first[bucket_idx] + (hash >> 32) % num_nics];
+    }
+
+    len = format_address(map->address, selected_nic, out_address, out_size);
+    return (len >= out_size ? (int)len + 1 : 0);
+}
+
+/* start a trace record for a resolution, if tracing is enabled */
+static void trace_begin(const char* in_address,
+                        const char* bucket_policy,
+                        const char* nic_policy)
+{
+    cache.tracing = mochi_plumber_trace_enabled();
+    if (!cache.tracing) return;
+
+    memset(&trace, 0, sizeof(trace));
+    trace.in_address    = in_address;
+    trace.bucket_policy = bucket_policy;
+    trace.nic_policy    = nic_policy;
+    trace.bucket        = -1;
+    cache.trace_mark    = mochi_plumber_trace_clock();
+}
+
+/* charge the time since the end of the last phase to this one */
+static void trace_phase(enum mochi_plumber_trace_phase phase)
+{
+    long now;
+
+    if (!cache.tracing) return;
+
+    now = mochi_plumber_trace_clock();
+    trace.phase_ns[phase] += now - cache.trace_mark;
+    cache.trace_mark = now;
+}
+
+/* finish and write the trace record, while the bucket is still valid */
+static void trace_end(int status, const char* address, const char* nic)
+{
+    if (!cache.tracing) return;
+
+    trace.status  = status;
+    trace.address = address;
+    trace.nic     = nic;
+    mochi_plumber_trace_write(&trace);
+    cache.tracing = 0;
+}
+
+/* Choose a transport for in_address if needed and decide whether it should
+ * be resolved at all.  On success *out_address is set to the address to
+ * build the result from (in_address, unless a transport had to be chosen)
+ * and *out_transport is set to the transport to select a NIC for, or to
+ * NULL if the address should be passed through unmodified.  nic_policy may
+ * be NULL if no NIC policy applies.
+ */
+static int prepare_address(const char*              in_address,
+                           const char*              bucket_policy,
+                           const char*              nic_policy,
+                           const char**             out_address,
+                           const struct transport** out_transport)
+{
+    const struct transport* transport;
+    const char*             sep;
+    size_t                  len;
+    int                     chosen = 0;
+    int                     ret;
+
+    *out_address   = in_address;
+    *out_transport = NULL;
+
+    /* the protocol is everything up to the "://", if there is one */
+    sep = strstr(in_address, "://");
+    len = sep ? (size_t)(sep - in_address) : strlen(in_address);
+
+    /* choose a transport first if the caller left that up to us */
+    if ((len == strlen("auto") && strncmp(in_address, "auto", len) == 0)
+        || memchr(in_address, '|', len)) {
+        ret = select_transport(in_address, cache.address,
+                               sizeof(cache.address));
+        if (ret < 0) return (-1);
+        in_address   = cache.address;
+        *out_address = in_address;
+        sep          = strstr(in_address, "://");
+        len          = sep - in_address;
+        chosen       = 1;
+    }
+
+    /* skip resolution if either policy is set to passthrough */
+    if ((nic_policy && strcmp(nic_policy, "passthrough") == 0)
+        || strcmp(bucket_policy, "passthrough") == 0) {
+        trace.passthrough = "policy";
+        return (0);
+    }
+
+    transport = find_transport(in_address, len);
+    if (!transport) {
+        /* don't know what this is; just pass it through */
+        trace.passthrough = "unknown transport";
+        return (0);
+    }
+    if (!chosen && !transport->named) {
+        trace.passthrough = "named transport";
+        return (0);
+    }
+
+    /* check to make sure the input address is not specific already */
+    len = strlen(in_address);
+    if (sep && (in_address[len - 1] != '/' || in_address[len - 2] != '/')) {
+        /* the address is already resolved to some degree; don't touch it */
+        trace.passthrough = "specific address";
+        return (0);
+    }
+
+    *out_transport = transport;
+    return (0);
+}
+
+/* Select a NIC for in_address.  On success *out_address is set to the
+ * address to build the result from (in_address, unless a transport had to
+ * be chosen) and *out_nic is set to the name of the selected NIC, or to NULL
+ * if the address should be passed through unmodified.  Both are only valid
+ * while the cache mutex is held.
+ */
+static int resolve_nic_locked(const char*  in_address,
+                              const char*  bucket_policy,
+                              const char*  nic_policy,
+                              const char** out_address,
+                              const char** out_nic)
+{
+    const struct transport* transport;
+    struct memo_entry*      memo;
+    const char*             env;
+    int                     ret;
+
+    *out_nic = NULL;
+
+    ret = prepare_address(in_address, bucket_policy, nic_policy, out_address,
+                          &transport);
+    trace_phase(MOCHI_PLUMBER_TRACE_PREPARE);
+    if (ret < 0 || !transport) return (ret);
+    in_address = *out_address;
+
+    /* Reuse the answer from an earlier call with the same arguments and
+     * binding, so that (for example) every endpoint in a process agrees on
+     * a roundrobin NIC.  A thread whose affinity has changed since then
+     * will not match and gets a fresh resolution, as does any thread once
+     * another job has registered for a share of the NICs.
+     */
+    if (cache.memo_enabled == 0) {
+        env                = getenv("MOCHI_PLUMBER_MEMO");
+        cache.memo_enabled = (env && strcmp(env, "0") == 0) ? -1 : 1;
+    }
+    if (cache.memo_enabled > 0) {
+        if (sched_getaffinity(0, sizeof(cache.memo_cpuset), &cache.memo_cpuset)
+            < 0) {
+            fprintf(stderr, "sched_getaffinity() failure.\n");
+            return (-1);
+        }
+        cache.memo_stamp
+            = job_partition_enabled() ? mochi_plumber_job_stamp() : 0;
+        memo = memo_lookup(in_address, bucket_policy, nic_policy);
+        trace_phase(MOCHI_PLUMBER_TRACE_MEMO);
+        if (memo) {
+            trace.source = "memo";
+            if (!memo->passthrough)
+                *out_nic = memo->nic;
+            else
+                trace.passthrough = "bucket without NIC";
+            return (0);
+        }
+    }
+
+    ret = resolve_nic_uncached(transport, bucket_policy, nic_policy, out_nic);
+    if (ret == 0 && cache.memo_enabled > 0)
+        memo_store(in_address, bucket_policy, nic_policy, *out_nic);
+
+    return (ret);
+}
+
+static struct region_map* region_map_find(const char* in_address,
+                                          const char* bucket_policy)
+{
+    struct region_map* map;
+
+    for (map = __atomic_load_n(&regions, __ATOMIC_ACQUIRE); map;
+         map = map->next) {
+        if (strcmp(map->in_address, in_address) == 0
+            && strcmp(map->bucket_policy, bucket_policy) == 0)
+            return (map);
+    }
+
+    return (NULL);
+}
+
+/* Build and publish the region map for an address and bucket policy.  The
+ * bucket for each NUMA node is the one nearest its PUs, and the bucket for
+ * each PU is the one that serves it.  A retired map with the same contents
+ * is published again instead, so that repeated invalidation (e.g., by a
+ * watch) doesn't keep adding maps that can never be freed.
+ */
+static struct region_map* region_map_build(const char* in_address,
+                                           const char* bucket_policy)
+{
+    const struct transport* transport;
+    struct bucket_table*    table = NULL;
+    struct region_map*      map;
+    struct region_map**     prev;
+    const char*             address;
+    hwloc_obj_t             obj   = NULL;
+    size_t                  bytes = 0;
+    char*                   next_name;
+    int                     num_entries = 0;
+    int                     num_nodes   = 0;
+    int                     num_cpus    = 0;
+    int                     nbuckets    = 0;
+    int                     i;
+    int                     j;
+    int                     n = 0;
+
+    if (strlen(in_address) >= sizeof(map->in_address)
+        || strlen(bucket_policy) >= sizeof(map->bucket_policy)) {
+        fprintf(stderr, "Error: address or policy too long.\n");
+        return (NULL);
+    }
+    if (prepare_address(in_address, bucket_policy, NULL, &address, &transport)
+        < 0)
+        return (NULL);
+    if (strlen(address) >= sizeof(map->address)) return (NULL);
+
+    if (transport) {
+        if (load_topology() < 0) return (NULL);
+        table = get_bucket_table(transport, bucket_policy);
+        if (!table) {
+            fprintf(stderr, "Error: setup_buckets() failure.\n");
+            return (NULL);
+        }
+        /* pass through if some bucket has no NICs */
+        if (!table->usable) table = NULL;
+    }
+    if (table) {
+        nbuckets  = table->nbuckets;
+        num_nodes = hwloc_bitmap_last(
+                        hwloc_topology_get_topology_nodeset(cache.topology))
+                  + 1;
+        num_cpus = hwloc_bitmap_last(
+                       hwloc_topology_get_topology_cpuset(cache.topology))
+                 + 1;
+        for (i = 0; i < nbuckets; i++) {
+            num_entries += table->buckets[i].num_nics;
+            for (j = 0; j < table->buckets[i].num_nics; j++)
+                bytes += strlen(table->buckets[i].nics[j]) + 1;
+        }
+    }
+
+    map = calloc(1, sizeof(*map) + num_entries * sizeof(*map->nics)
+                        + (nbuckets + 1 + num_nodes + num_cpus) * sizeof(int)
+                        + bytes);
+    if (!map) return (NULL);
+    strcpy(map->in_address, in_address);
+    strcpy(map->bucket_policy, bucket_policy);
+    strcpy(map->address, address);
+    map->nbuckets    = nbuckets;
+    map->num_nodes   = num_nodes;
+    map->num_cpus    = num_cpus;
+    map->page_mask   = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    map->nics        = (char**)(map + 1);
+    map->first       = (int*)(map->nics + num_entries);
+    map->node_bucket = map->first + nbuckets + 1;
+    map->cpu_bucket  = map->node_bucket + num_nodes;
+    next_name        = (char*)(map->cpu_bucket + num_cpus);
+
+    for (i = 0; i < nbuckets; i++) {
+        map->first[i] = n;
+        for (j = 0; j < table->buckets[i].num_nics; j++) {
+            strcpy(next_name, table->buckets[i].nics[j]);
+            map->nics[n++] = next_name;
+            next_name += strlen(next_name) + 1;
+        }
+    }
+    map->first[nbuckets] = n;
+
+    for (i = 0; i < num_nodes; i++) map->node_bucket[i] = -1;
+    while (table
+           && (obj = hwloc_get_next_obj_by_type(cache.topology,
+                                                HWLOC_OBJ_NUMANODE, obj))) {
+        i = overlap_bucket(nbuckets, table->buckets, obj->cpuset, NULL);
+        if (i < nbuckets) map->node_bucket[obj->os_index] = i;
+    }
+    for (i = 0; i < num_cpus; i++) {
+        map->cpu_bucket[i] = -1;
+        for (j = nbuckets - 1; j >= 0; j--) {
+            if (hwloc_bitmap_isset(table->buckets[j].cpuset, i))
+                map->cpu_bucket[i] = j;
+        }
+    }
+
+    for (prev = &cache.retired; *prev; prev = &(*prev)->retired) {
+        if (region_map_equal(*prev, map)) {
+            free(map);
+            map          = *prev;
+            *prev        = map->retired;
+            map->retired = NULL;
+            break;
+        }
+    }
+
+    map->next = regions;
+    __atomic_store_n(&regions, map, __ATOMIC_RELEASE);
+
+    return (map);
+}
+
+/* whether two region maps are for the same address and policy and would
+ * map every region to the same NIC
+ */
+static int region_map_equal(const struct region_map* a,
+                            const struct region_map* b)
+{
+    int i;
+
+    if (strcmp(a->in_address, b->in_address) != 0
+        || strcmp(a->bucket_policy, b->bucket_policy) != 0
+        || strcmp(a->address, b->address) != 0 || a->nbuckets != b->nbuckets
+        || a->num_nodes != b->num_nodes || a->num_cpus != b->num_cpus
+        || a->page_mask != b->page_mask
+        || memcmp(a->first, b->first, (a->nbuckets + 1) * sizeof(int)) != 0
+        || memcmp(a->node_bucket, b->node_bucket, a->num_nodes * sizeof(int))
+               != 0
+        || memcmp(a->cpu_bucket, b->cpu_bucket, a->num_cpus * sizeof(int))
+               != 0)
+        return (0);
+    for (i = 0; i < a->first[a->nbuckets]; i++) {
+        if (strcmp(a->nics[i], b->nics[i]) != 0) return (0);
+    }
+
+    return (1);
+}
+
+/* The bucket nearest the NUMA node holding the first page of a region, or
+ * its last page if the first one has no placement.  Both are sampled with a
+ * single move_pages() call, which without target nodes only reports where
+ * pages are, without allocating.  Pages that have not been touched yet have
+ * no placement; they will most likely be placed near the calling thread when
+ * they are.
+ */
+static int region_bucket(const struct region_map* map,
+                         const void*              region,
+                         size_t                   region_len)
+{
+    void*         pages[2];
+    int           status[2] = {-1, -1};
+    unsigned long count     = 1;
+    unsigned long i;
+    int           cpu;
+
+    if (map->nbuckets == 1) return (0);
+
+    pages[0] = (void*)((uintptr_t)region & map->page_mask);
+    pages[1] = (void*)(((uintptr_t)region + region_len - 1) & map->page_mask);
+    if (pages[1] != pages[0]) count = 2;
+    if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) == 0) {
+        for (i = 0; i < count; i++) {
+            if (status[i] >= 0 && status[i] < map->num_nodes
+                && map->node_bucket[status[i]] >= 0)
+                return (map->node_bucket[status[i]]);
+        }
+    }
+
+    cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= map->num_cpus) return (-1);
+
+    return (map->cpu_bucket[cpu]);
+}
+
+/* Resolution proper, once the address is known to need a NIC */
+static int resolve_nic_uncached(const struct transport* transport,
+                                const char*             bucket_policy,
+                                const char*             nic_policy,
+                                const char**            out_nic)
+{
+    struct bucket_table*   table;
+    hwloc_const_nodeset_t  membind = NULL;
+    hwloc_membind_policy_t policy;
+    int                    overlap;
+    int                    bound;
+    int                    ret;
+
+    /* the full binding is only needed (and relatively costly to query) for
+     * the byset policy, overlap selection, and job partitioning
+     */
+    bucket_policy_base(bucket_policy, &overlap);
+    bound = strcmp(nic_policy, "byset") == 0 || overlap
+         || job_partition_enabled();
+    if (bound) {
+        if (load_topology() < 0) return (-1);
+        ret = hwloc_get_cpubind(cache.topology, cache.bound,
+                                HWLOC_CPUBIND_PROCESS);
+        if (ret < 0) {
+            fprintf(stderr, "hwloc_get_cpubind() failure.\n");
+            return (-1);
+        }
+        /* a binding too fragmented to send is resolved in-process */
+        if (hwloc_bitmap_list_snprintf(cache.cpus, sizeof(cache.cpus),
+                                       cache.bound)
+            >= (int)sizeof(cache.cpus))
+            cache.cpus[0] = '\0';
+    }
+
+    /* overlap selection also weighs where the process's memory is bound,
+     * unless it is allowed to use all of it
+     */
+    if (overlap
+        && hwloc_get_membind(cache.topology, cache.membind, &policy,
+                             HWLOC_MEMBIND_PROCESS | HWLOC_MEMBIND_BYNODESET)
+               == 0
+        && !hwloc_bitmap_isincluded(
+            hwloc_topology_get_topology_nodeset(cache.topology),
+            cache.membind)) {
+        membind = cache.membind;
+        hwloc_bitmap_list_snprintf(cache.mems, sizeof(cache.mems), membind);
+    }
+    trace_phase(MOCHI_PLUMBER_TRACE_TOPOLOGY);
+
+    /* Let the node-local broker decide if one is running.  It balances all
+     * of its clients, so it is bypassed when NICs are partitioned by job.
+     */
+    ret = -1;
+    if (!job_partition_enabled() && (!bound || cache.cpus[0]))
+        ret = mochi_plumber_broker_resolve(
+            transport->name, bucket_policy, nic_policy,
+            bound ? cache.cpus : NULL, membind ? cache.mems : NULL,
+            cache.broker_nic, sizeof(cache.broker_nic));
+    trace_phase(MOCHI_PLUMBER_TRACE_BROKER);
+    if (ret == 0) {
+        trace.source = "broker";
+        if (strlen(cache.broker_nic))
+            *out_nic = cache.broker_nic;
+        else
+            trace.passthrough = "bucket without NIC";
+        return (0);
+    }
+    trace.source = "local";
+
+    /* get topology */
+    ret = load_topology();
+    if (ret < 0) return (-1);
+
+    /* find out where this process is running */
+    ret = hwloc_get_last_cpu_location(cache.topology, cache.cpuset,
+                                      HWLOC_CPUBIND_THREAD);
+    if (ret < 0) {
+        fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
+        return (-1);
+    }
+    if (!bound) hwloc_bitmap_copy(cache.bound, cache.cpuset);
+    trace_phase(MOCHI_PLUMBER_TRACE_TOPOLOGY);
+
+    /* divide up NICs into buckets that we will later draw from */
+    table = get_bucket_table(transport, bucket_policy);
+    trace_phase(MOCHI_PLUMBER_TRACE_TABLE);
+    if (!table) {
+        fprintf(stderr, "Error: setup_buckets() failure.\n");
+        return (-1);
+    }
+
+    /* sanity check: every bucket must have at least one NIC */
+    if (!table->usable) {
+        /* If we hit this point, then the node configuration is such
+         * that we shouldn't be attempting to select network cards with
+         * the specified policy (some buckets have no network cards
+         * assigned to them).  Silently pass through input address.
+         *
+         * TODO: should this be a warning?  The "all" bucket policy
+         * would have been fine.  Does matter on any known systems as of
+         * December 2024.
+         */
+        trace.passthrough = "bucket without NIC";
+        return (0);
+    }
+
+    ret = select_nic(&cache.topology, bucket_policy, nic_policy,
+                     table->nbuckets, table->buckets, cache.cpuset,
+                     cache.bound, membind, NULL, NULL, out_nic);
+    trace_phase(MOCHI_PLUMBER_TRACE_SELECT);
+    if (ret < 0) {
+        fprintf(stderr, "Error: failed to select NIC.\n");
+        *out_nic = NULL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+static struct memo_entry* memo_lookup(const char* in_address,
+                                      const char* bucket_policy,
+                                      const char* nic_policy)
+{
+    int i;
+
+    for (i = 0; i < MEMO_ENTRIES; i++) {
+        if (cache.memo[i].valid
+            && CPU_EQUAL(&cache.memo[i].cpuset, &cache.memo_cpuset)
+            && cache.memo[i].stamp == cache.memo_stamp
+            && strcmp(cache.memo[i].in_address, in_address) == 0
+            && strcmp(cache.memo[i].bucket_policy, bucket_policy) == 0
+            && strcmp(cache.memo[i].nic_policy, nic_policy) == 0)
+            return (&cache.memo[i]);
+    }
+
+    return (NULL);
+}
+
+/* remember a resolution made with the binding in cache.memo_cpuset and the
+ * job registry as of cache.memo_stamp, replacing the oldest entry once the
+ * memo is full
+ */
+static void memo_store(const char* in_address,
+                       const char* bucket_policy,
+                       const char* nic_policy,
+                       const char* nic)
+{
+    struct memo_entry* memo = &cache.memo[cache.memo_next];
+
+    /* arguments too long to remember are simply resolved every time */
+    if (strlen(in_address) >= sizeof(memo->in_address)
+        || strlen(bucket_policy) >= sizeof(memo->bucket_policy)
+        || strlen(nic_policy) >= sizeof(memo->nic_policy)
+        || (nic && strlen(nic) >= sizeof(memo->nic)))
+        return;
+
+    strcpy(memo->in_address, in_address);
+    strcpy(memo->bucket_policy, bucket_policy);
+    strcpy(memo->nic_policy, nic_policy);
+    memo->cpuset      = cache.memo_cpuset;
+    memo->stamp       = cache.memo_stamp;
+    memo->passthrough = (nic == NULL);
+    strcpy(memo->nic, nic ? nic : "");
+    memo->valid = 1;
+
+    cache.memo_next = (cache.memo_next + 1) % MEMO_ENTRIES;
+}
+
+int mochi_plumber_select_nic_at(const char*           transport_name,
+                                const char*           bucket_policy,
+                                const char*           nic_policy,
+                                hwloc_const_cpuset_t  last_cpu,
+                                hwloc_const_cpuset_t  cpuset,
+                                hwloc_const_nodeset_t membind,
+                                mochi_plumber_pick_fn pick,
+                                void*                 pick_arg,
+                                char*                 out_nic,
+                                size_t                out_size)
+{
+    const struct transport* transport;
+    struct bucket_table*    table;
+    const char*             selected_nic = NULL;
+    int                     ret          = 0;
+
+    pthread_mutex_lock(&cache.mutex);
+
+    transport = find_transport(transport_name, strlen(transport_name));
+    if (!transport || load_topology() < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    table = get_bucket_table(transport, bucket_policy);
+    if (!table) {
+        fprintf(stderr, "Error: setup_buckets() failure.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* no NIC selection is possible with this policy; pass through */
+    if (!table->usable) goto out;
+
+    ret = select_nic(&cache.topology, bucket_policy, nic_policy,
+                     table->nbuckets, table->buckets, last_cpu, cpuset,
+                     membind, pick, pick_arg, &selected_nic);
+
+out:
+    snprintf(out_nic, out_size, "%s", selected_nic ? selected_nic : "");
+    pthread_mutex_unlock(&cache.mutex);
+
+    return (ret);
+}
+
+void mochi_plumber_invalidate(void)
+{
+    struct bucket_table* table;
+    struct region_map*   map;
+    int                  i;
+
+    pthread_mutex_lock(&cache.mutex);
+
+    /* region maps may still be in use by readers, so they are only
+     * unpublished
+     */
+    for (map = regions; map; map = map->next) {
+        map->retired  = cache.retired;
+        cache.retired = map;
+    }
+    __atomic_store_n(&regions, NULL, __ATOMIC_RELEASE);
+
+    /* the tables refer to the topology, so they go first */
+    while ((table = cache.tables)) {
+        cache.tables = table->next;
+        free_bucket_table(table);
+    }
+    if (cache.topology_loaded) {
+        hwloc_topology_destroy(cache.topology);
+        hwloc_bitmap_free(cache.cpuset);
+        hwloc_bitmap_free(cache.bound);
+        hwloc_bitmap_free(cache.scratch);
+        hwloc_bitmap_free(cache.anchor);
+        hwloc_bitmap_free(cache.membind);
+        cache.topology_loaded = 0;
+    }
+    for (i = 0; i < (int)NUM_TRANSPORTS; i++) cache.available[i] = 0;
+    for (i = 0; i < MEMO_ENTRIES; i++) cache.memo[i].valid = 0;
+
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+char* mochi_plumber_nic_fingerprint(void)
+{
+    struct fi_info*     info;
+    struct fi_info*     cur;
+    struct fi_pci_attr* pci;
+    char*               buf;
+    char*               tmp;
+    size_t              len = 0;
+    int                 entry_len;
+    int                 link;
+    size_t              i;
+
+    buf = calloc(1, 1);
+    if (!buf) return (NULL);
+    for (i = 0; i < NUM_TRANSPORTS; i++) {
+        if (transport_getinfo(&transports[i], &info) != 0) continue;
+        for (cur = info; cur; cur = cur->next) {
+            if (!is_local_nic(info, cur)) continue;
+            pci  = &cur->nic->bus_attr->attr.pci;
+            link = mochi_plumber_link_state(pci->domain_id, pci->bus_id,
+                                            pci->device_id, pci->function_id);
+            entry_len = snprintf(NULL, 0, "%s:%s@%04x:%02x:%02x.%x=%s;",
+                                 transports[i].prov_name,
+                                 cur->domain_attr->name, pci->domain_id,
+                                 pci->bus_id, pci->device_id,
+                                 pci->function_id,
+                                 link < 0 ? "?" : (link ? "up" : "down"));
+            tmp = entry_len < 0 ? NULL : realloc(buf, len + entry_len + 1);
+            if (!tmp) {
+                fi_freeinfo(info);
+                free(buf);
+                return (NULL);
+            }
+            buf = tmp;
+            len += snprintf(buf + len, entry_len + 1,
+                            "%s:%s@%04x:%02x:%02x.%x=%s;",
+                            transports[i].prov_name, cur->domain_attr->name,
+                            pci->domain_id, pci->bus_id, pci->device_id,
+                            pci->function_id,
+                            link < 0 ? "?" : (link ? "up" : "down"));
+        }
+        fi_freeinfo(info);
+    }
+
+    return (buf);
+}
+
+/* Find the transport for a Mercury protocol string of length len.  The
+ * protocol may carry provider options after a ';' (e.g.,
+ * "ofi+verbs;ofi_rxm").
+ */
+static const struct transport* find_transport(const char* protocol,
+                                              size_t      len)
+{
+    const char* names[2];
+    size_t      n;
+    size_t      i;
+    int         j;
+
+    for (i = 0; i < NUM_TRANSPORTS; i++) {
+        names[0] = transports[i].name;
+        names[1] = transports[i].alias;
+        for (j = 0; j < 2 && names[j]; j++) {
+            n = strlen(names[j]);
+            if (len >= n && strncmp(protocol, names[j], n) == 0
+                && (len == n || protocol[n] == ';'))
+                return (&transports[i]);
+        }
+    }
+
+    return (NULL);
+}
+
+/* Rewrite an address whose protocol is "auto" or a '|' separated list of
+ * preferences into buf, using the first transport that is available.
+ */
+static int select_transport(const char* in_address, char* buf, size_t size)
+{
+    const struct transport* transport;
+    const char*             sep;
+    const char*             start;
+    const char*             end;
+    size_t                  i;
+    int                     ret;
+
+    sep = strstr(in_address, "://");
+    if (!sep) sep = "://";
+
+    if (strncmp(in_address, "auto", strlen("auto")) == 0
+        && (in_address[strlen("auto")] == '\0'
+            || in_address + strlen("auto") == sep)) {
+        for (i = 0; i < NUM_TRANSPORTS; i++) {
+            if (transport_available(&transports[i]) <= 0) continue;
+            ret = snprintf(buf, size, "%s%s", transports[i].name, sep);
+            return (ret < (int)size ? 0 : -1);
+        }
+    } else {
+        for (start = in_address; *start && start != sep; start = end + 1) {
+            end = start + strcspn(start, "|:");
+            if (end == start) continue;
+            transport = find_transport(start, end - start);
+            if (!transport) {
+                fprintf(stderr, "Error: unknown transport \"%.*s\".\n",
+                        (int)(end - start), start);
+                return (-1);
+            }
+            if (transport_available(transport) > 0) {
+                ret = snprintf(buf, size, "%.*s%s", (int)(end - start), start,
+                               sep);
+                return (ret < (int)size ? 0 : -1);
+            }
+            if (*end != '|') break;
+        }
+    }
+
+    fprintf(stderr, "Error: no transport in \"%s\" is available.\n",
+            in_address);
+    return (-1);
+}
+
+/* Returns 1 if libfabric reports a local PCI NIC for the transport (or any
+ * interface at all, for transports that don't need a NIC), 0 if not.  The
+ * answer is cached for the life of the process.
+ */
+static int transport_available(const struct transport* transport)
+{
+    int             idx = transport - transports;
+    struct fi_info* info;
+    struct fi_info* cur;
+
+    if (cache.available[idx] == 0) {
+        cache.available[idx] = -1;
+        if (transport_getinfo(transport, &info) == 0) {
+            for (cur = info; cur; cur = cur->next) {
+                if (!transport->needs_nic || is_local_nic(info, cur))
+                    cache.available[idx] = 1;
+            }
+            fi_freeinfo(info);
+        }
+    }
+
+    return (cache.available[idx] > 0);
+}
+
+/* query libfabric for the interfaces that a transport can use */
+static int transport_getinfo(const struct transport* transport,
+                             struct fi_info**        info)
+{
+    struct fi_info* hints;
+    int             ret;
+
+    hints = fi_allocinfo();
+    if (!hints) return (-1);
+    /* These are required as input if we want to filter the results; they
+     * indicate functionality that the caller is prepared to provide.  This
+     * is just a query, so we want wildcard options except that we must disable
+     * deprecated memory registration modes.
+     */
+    hints->mode                   = ~0;
+    hints->domain_attr->mode      = ~0;
+    hints->domain_attr->mr_mode   = ~3;
+    hints->fabric_attr->prov_name = strdup(transport->prov_name);
+    hints->ep_attr->protocol      = transport->protocol;
+    ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION), NULL, NULL,
+                     0, hints, info);
+    fi_freeinfo(hints);
+
+    return (ret);
+}
+
+/* Whether cur describes a NIC that we can locate in the topology, skipping
+ * any additional entries (e.g., for other endpoint types) for the same
+ * domain.
+ */
+static int is_local_nic(struct fi_info* info, struct fi_info* cur)
+{
+    struct fi_info* prev;
+
+    if (!cur->nic || !cur->nic->bus_attr
+        || cur->nic->bus_attr->bus_type != FI_BUS_PCI)
+        return (0);
+
+    for (prev = info; prev != cur; prev = prev->next) {
+        if (strcmp(prev->domain_attr->name, cur->domain_attr->name) == 0)
+            return (0);
+    }
+
+    return (1);
+}
 
-static char* canonicalize_addr_string(const char* in_address)
+static int load_topology(void)
 {
-    char* found = NULL;
-    char* canon = NULL;
+    if (cache.topology_loaded) return (0);
 
-    found = strstr(in_address, "://");
-    if (found) return (strdup(in_address));
+    cache.cpuset  = hwloc_bitmap_alloc();
+    cache.bound   = hwloc_bitmap_alloc();
+    cache.scratch = hwloc_bitmap_alloc();
+    cache.anchor  = hwloc_bitmap_alloc();
+    cache.membind = hwloc_bitmap_alloc();
+    if (!cache.cpuset || !cache.bound || !cache.scratch || !cache.anchor
+        || !cache.membind) {
+        hwloc_bitmap_free(cache.cpuset);
+        hwloc_bitmap_free(cache.bound);
+        hwloc_bitmap_free(cache.scratch);
+        hwloc_bitmap_free(cache.anchor);
+        hwloc_bitmap_free(cache.membind);
+        return (-1);
+    }
 
-    /* assume that if there is no :// present in the address string, then
-     * the string must just be an na identifier for Mercury.  Append a "://"
-     * to a new string and return it.
+    /* PUs and NUMA nodes outside of the process's cgroup are left out of
+     * the topology (HWLOC_TOPOLOGY_FLAG_INCLUDE_DISALLOWED is not set), so
+     * buckets and the NIC mappings within them only cover resources that
+     * the process can actually use
      */
-    canon = malloc(strlen(in_address) + 4);
-    if (!canon) return (NULL);
-    sprintf(canon, "%s://", in_address);
-    return (canon);
+    hwloc_topology_init(&cache.topology);
+    hwloc_topology_set_io_types_filter(cache.topology,
+                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
+    hwloc_topology_load(cache.topology);
+    cache.topology_loaded = 1;
+
+    return (0);
 }
 
-int mochi_plumber_resolve_nic(const char* in_address,
-                              const char* bucket_policy,
-                              const char* nic_policy,
-                              char**      out_address)
+/* Length of a bucket policy without any OVERLAP_SUFFIX; *overlap (if not
+ * NULL) is set to whether the suffix is present.
+ */
+static size_t bucket_policy_base(const char* bucket_policy, int* overlap)
 {
+    size_t len    = strlen(bucket_policy);
+    size_t suffix = strlen(OVERLAP_SUFFIX);
+    int    found;
 
-    int              nbuckets = 0;
-    hwloc_topology_t topology;
-    struct bucket*   buckets = NULL;
-    int              ret;
-    int              i;
-    const char*      selected_nic;
-    char*            canon_address;
+    found = len > suffix
+         && strcmp(bucket_policy + len - suffix, OVERLAP_SUFFIX) == 0;
+    if (overlap) *overlap = found;
 
-    canon_address = canonicalize_addr_string(in_address);
-    if (!canon_address) return (-1);
+    return (found ? len - suffix : len);
+}
 
-    /* skip resolution if either policy is set to passthrough */
-    if (strcmp(nic_policy, "passthrough") == 0
-        || strcmp(bucket_policy, "passthrough") == 0) {
-        *out_address = canon_address;
-        return (0);
-    }
+/* find the bucket table for a transport and bucket policy, building it if
+ * needed
+ */
+static struct bucket_table*
+get_bucket_table(const struct transport* transport, const char* bucket_policy)
+{
+    struct bucket_table* table;
+    size_t               len;
+    int                  ret;
+    int                  i;
 
-    /* for now we only manipulate CXI addresses */
-    if (strncmp(canon_address, "cxi", strlen("cxi")) != 0
-        && strncmp(canon_address, "ofi+cxi", strlen("ofi+cxi")) != 0) {
-        /* don't know what this is; just pass it through */
-        *out_address = canon_address;
-        return (0);
-    }
+    /* the buckets are the same however they are selected from */
+    len = bucket_policy_base(bucket_policy, NULL);
 
-    /* check to make sure the input address is not specific already */
-    if (canon_address[strlen(canon_address) - 1] != '/'
-        || canon_address[strlen(canon_address) - 2] != '/') {
-        /* the address is already resolved to some degree; don't touch it */
-        *out_address = canon_address;
-        return (0);
+    for (table = cache.tables; table; table = table->next) {
+        if (table->transport == transport
+            && strlen(table->bucket_policy) == len
+            && strncmp(table->bucket_policy, bucket_policy, len) == 0)
+            return (table);
     }
 
-    /* get topology */
-    hwloc_topology_init(&topology);
-    hwloc_topology_set_io_types_filter(topology,
-                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
-    hwloc_topology_load(topology);
+    table = calloc(1, sizeof(*table));
+    if (!table) return (NULL);
+    table->bucket_policy = strndup(bucket_policy, len);
+    if (!table->bucket_policy) {
+        free(table);
+        return (NULL);
+    }
 
-    /* divide up NICs into buckets that we will later draw from */
-    ret = setup_buckets(&topology, bucket_policy, &nbuckets, &buckets);
+    table->transport = transport;
+    ret = setup_buckets(&cache.topology, transport, table->bucket_policy,
+                        &table->nbuckets, &table->buckets, &table->num_nics,
+                        &table->nic_irqs);
     if (ret < 0) {
-        fprintf(stderr, "Error: setup_buckets() failure.\n");
-        hwloc_topology_destroy(topology);
-        free(canon_address);
-        return (-1);
+        free(table->bucket_policy);
+        free(table);
+        return (NULL);
     }
 
-    /* sanity check: every bucket must have at least one NIC */
-    for (i = 0; i < nbuckets; i++) {
-        if (buckets[i].num_nics < 1) {
-            // fprintf(stderr, "Error: bucket %d has no NICs\n", i);
-
-            /* If we hit this point, then the node configuration is such
-             * that we shouldn't be attempting to select network cards with
-             * the specified policy (some buckets have no network cards
-             * assigned to them).  Silently pass through input address.
-             *
-             * TODO: should this be a warning?  The "all" bucket policy
-             * would have been fine.  Does matter on any known systems as of
-             * December 2024.
-             */
-            release_buckets(nbuckets, buckets);
-            hwloc_topology_destroy(topology);
-            *out_address = canon_address;
-            return (0);
-        }
+    table->usable = 1;
+    for (i = 0; i < table->nbuckets; i++) {
+        if (table->buckets[i].num_nics < 1) table->usable = 0;
     }
 
-    ret = select_nic(&topology, bucket_policy, nic_policy, nbuckets, buckets,
-                     &selected_nic);
-    if (ret < 0) {
-        fprintf(stderr, "Error: failed to select NIC.\n");
-        release_buckets(nbuckets, buckets);
-        hwloc_topology_destroy(topology);
-        free(canon_address);
-        return (-1);
+    table->next  = cache.tables;
+    cache.tables = table;
+
+    return (table);
+}
+
+static void free_bucket_table(struct bucket_table* table)
+{
+    int i;
+
+    for (i = 0; i < table->num_nics; i++)
+        mochi_plumber_irq_vectors_free(table->nic_irqs[i].vectors,
+                                       table->nic_irqs[i].num_vectors);
+    free(table->nic_irqs);
+    free(table->buckets);
+    free(table->bucket_policy);
+    free(table);
+}
+
+/* whether NICs are partitioned among co-located jobs */
+static int job_partition_enabled(void)
+{
+    const char* env;
+
+    if (cache.partition == 0) {
+        env             = getenv("MOCHI_PLUMBER_JOB_PARTITION");
+        cache.partition = (env && strcmp(env, "1") == 0) ? 1 : -1;
     }
 
-    /* generate new address with specific nic */
-    *out_address = malloc(strlen(canon_address) + strlen(selected_nic) + 1);
-    sprintf(*out_address, "%s%s", canon_address, selected_nic);
+    return (cache.partition > 0);
+}
 
-    release_buckets(nbuckets, buckets);
-    hwloc_topology_destroy(topology);
+/* Weigh each bucket by how many of the PUs in cpuset it serves, plus how
+ * many of the PUs in memcpus (if not NULL) it serves, and return the index
+ * of the heaviest (the first, on ties).  Returns nbuckets if no bucket
+ * overlaps either.
+ */
+static int overlap_bucket(int                  nbuckets,
+                          struct bucket*       buckets,
+                          hwloc_const_cpuset_t cpuset,
+                          hwloc_const_cpuset_t memcpus)
+{
+    int bucket_idx = nbuckets;
+    int best       = 0;
+    int weight;
+    int i;
 
-    free(canon_address);
-    return (0);
+    for (i = 0; i < nbuckets; i++) {
+        hwloc_bitmap_and(cache.scratch, cpuset, buckets[i].cpuset);
+        weight = hwloc_bitmap_weight(cache.scratch);
+        if (memcpus) {
+            hwloc_bitmap_and(cache.scratch, memcpus, buckets[i].cpuset);
+            weight += hwloc_bitmap_weight(cache.scratch);
+        }
+        if (weight > best) {
+            best       = weight;
+            bucket_idx = i;
+        }
+    }
+
+    return (bucket_idx);
 }
 
-static int select_nic(hwloc_topology_t* topology,
-                      const char*       bucket_policy,
-                      const char*       nic_policy,
-                      int               nbuckets,
-                      struct bucket*    buckets,
-                      const char**      out_nic)
+/* Select a NIC for a process that last ran on last_cpu and is bound to
+ * cpuset (and to the memory in membind, if not NULL).  If pick is set, it
+ * arbitrates the roundrobin policy in place of the shared token files, and
+ * the random policy in place of a generator seeded by pid.
+ */
+static int select_nic(hwloc_topology_t*     topology,
+                      const char*           bucket_policy,
+                      const char*           nic_policy,
+                      int                   nbuckets,
+                      struct bucket*        buckets,
+                      hwloc_const_cpuset_t  last_cpu,
+                      hwloc_const_cpuset_t  cpuset,
+                      hwloc_const_nodeset_t membind,
+                      mochi_plumber_pick_fn pick,
+                      void*                 pick_arg,
+                      const char**          out_nic)
 {
-    int             bucket_idx = 0;
-    int             ret;
-    hwloc_cpuset_t  last_cpu;
-    hwloc_nodeset_t last_numa;
-    hwloc_obj_t     package;
-    hwloc_obj_t     covering;
-
-    /* figure out which bucket to draw from */
-    if (nbuckets == 1)
-        bucket_idx = 0;
-    else {
-        if (strcmp(bucket_policy, "numa") == 0) {
-            last_cpu  = hwloc_bitmap_alloc();
-            last_numa = hwloc_bitmap_alloc();
-            assert(last_cpu && last_numa);
-
-            /* select a bucket based on the numa domain that this process is
-             * executing in
-             */
-            ret = hwloc_get_last_cpu_location(*topology, last_cpu,
-                                              HWLOC_CPUBIND_THREAD);
-            if (ret < 0) {
-                hwloc_bitmap_free(last_cpu);
-                hwloc_bitmap_free(last_numa);
-                fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
-                return (-1);
-            }
-            hwloc_cpuset_to_nodeset(*topology, last_cpu, last_numa);
-            bucket_idx = hwloc_bitmap_first(last_numa);
-            assert(bucket_idx < nbuckets);
-
-            hwloc_bitmap_free(last_cpu);
-            hwloc_bitmap_free(last_numa);
-        } else if (strcmp(bucket_policy, "package") == 0) {
-            last_cpu = hwloc_bitmap_alloc();
-            assert(last_cpu);
-
-            /* select a bucket based on the package that this process is
-             * executing in
-             */
-            ret = hwloc_get_last_cpu_location(*topology, last_cpu,
-                                              HWLOC_CPUBIND_THREAD);
-            if (ret < 0) {
-                hwloc_bitmap_free(last_cpu);
-                fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
-                return (-1);
-            }
-            covering = hwloc_get_obj_covering_cpuset(*topology, last_cpu);
-            package  = hwloc_get_ancestor_obj_by_type(
-                *topology, HWLOC_OBJ_PACKAGE, covering);
+    struct bucket* bucket;
+    struct bucket  share;
+    int            bucket_idx = nbuckets;
+    int            overlap;
+    int            first;
+    int            count;
+    int            ret;
 
-            bucket_idx = package->os_index;
-            assert(bucket_idx < nbuckets);
+    /* draw from the bucket that best overlaps the binding, if asked */
+    bucket_policy_base(bucket_policy, &overlap);
+    if (overlap) {
+        if (membind)
+            hwloc_cpuset_from_nodeset(*topology, cache.anchor, membind);
+        bucket_idx = overlap_bucket(nbuckets, buckets, cpuset,
+                                    membind ? cache.anchor : NULL);
 
-            hwloc_bitmap_free(last_cpu);
-        } else {
-            fprintf(stderr, "Error: inconsistent bucket policy %s.\n",
-                    bucket_policy);
-            return (-1);
+        /* NICs within the bucket are chosen relative to a PU inside it */
+        if (bucket_idx < nbuckets
+            && !hwloc_bitmap_intersects(last_cpu,
+                                        buckets[bucket_idx].cpuset)) {
+            hwloc_bitmap_and(cache.anchor, cpuset, buckets[bucket_idx].cpuset);
+            if (hwloc_bitmap_iszero(cache.anchor))
+                hwloc_bitmap_copy(cache.anchor, buckets[bucket_idx].cpuset);
+            hwloc_bitmap_only(cache.anchor, hwloc_bitmap_first(cache.anchor));
+            last_cpu = cache.anchor;
+        }
+    }
+
+    /* otherwise draw from the bucket that serves the PU this process is
+     * executing on
+     */
+    if (bucket_idx == nbuckets) {
+        for (bucket_idx = 0; bucket_idx < nbuckets; bucket_idx++) {
+            if (hwloc_bitmap_intersects(buckets[bucket_idx].cpuset, last_cpu))
+                break;
         }
     }
+    if (bucket_idx == nbuckets) {
+        fprintf(stderr, "Error: no %s bucket serves the current PU.\n",
+                bucket_policy);
+        return (-1);
+    }
+
+    /* confine the job to its share of the bucket's NICs, if asked */
+    bucket = &buckets[bucket_idx];
+    if (!pick && bucket->num_nics > 1 && job_partition_enabled()
+        && mochi_plumber_job_partition(bucket->cpuset, cpuset,
+                                       bucket->num_nics, &first, &count)
+               == 0) {
+        share.num_nics = count;
+        share.nics     = bucket->nics + first;
+        share.irqs     = bucket->irqs + first;
+        share.cpuset   = bucket->cpuset;
+        bucket         = &share;
+    }
+
+    trace.bucket   = bucket_idx;
+    trace.num_nics = bucket->num_nics;
+    trace.nics     = bucket->nics;
 
     /* select a NIC from within the chosen bucket */
-    if (buckets[bucket_idx].num_nics == 1) {
-        *out_nic = buckets[bucket_idx].nics[0];
+    if (bucket->num_nics == 1) {
+        *out_nic = bucket->nics[0];
         return (0);
     }
 
     if (strcmp(nic_policy, "roundrobin") == 0) {
-        ret = select_nic_roundrobin(bucket_idx, &buckets[bucket_idx], out_nic);
+        ret = select_nic_roundrobin(bucket_idx, bucket, pick, pick_arg,
+                                    out_nic);
     } else if (strcmp(nic_policy, "random") == 0) {
-        ret = select_nic_random(bucket_idx, &buckets[bucket_idx], out_nic);
+        ret = select_nic_random(bucket_idx, bucket, pick, pick_arg, out_nic);
     } else if (strcmp(nic_policy, "bycore") == 0) {
-        ret = select_nic_bycore(topology, bucket_idx, &buckets[bucket_idx],
+        ret = select_nic_bycore(topology, bucket_idx, bucket, last_cpu,
                                 out_nic);
     } else if (strcmp(nic_policy, "byset") == 0) {
-        ret = select_nic_byset(topology, bucket_idx, &buckets[bucket_idx],
-                               out_nic);
+        ret = select_nic_byset(topology, bucket_idx, bucket, cpuset, out_nic);
+    } else if (strcmp(nic_policy, "irq") == 0) {
+        ret = select_nic_irq(topology, bucket_idx, bucket, last_cpu, out_nic);
     } else {
         fprintf(stderr, "Error: unknown nic_policy \"%s\"\n", nic_policy);
         ret = -1;
@@ -259,16 +1484,48 @@ static int select_nic(hwloc_topology_t* topology,
     return (ret);
 }
 
-static int select_nic_roundrobin(int            bucket_idx,
-                                 struct bucket* bucket,
-                                 const char**   out_nic)
+void mochi_plumber_user_dir(char* path, size_t size)
 {
-    int  ret;
-    char tokenpath[256] = {0};
-    int  fd;
-    int  nic_idx = -1;
+    struct passwd  pw;
+    struct passwd* found = NULL;
+    char           buf[1024];
+    const char*    login = getlogin();
+
+    /* there is no login name without a controlling terminal (e.g., under
+     * some batch schedulers or in containers)
+     */
+    if (!login && getpwuid_r(geteuid(), &pw, buf, sizeof(buf), &found) == 0
+        && found)
+        login = pw.pw_name;
+
+    if (login)
+        snprintf(path, size, "/tmp/%s-mochi-plumber", login);
+    else
+        snprintf(path, size, "/tmp/%d-mochi-plumber", (int)geteuid());
+}
+
+static int select_nic_roundrobin(int                   bucket_idx,
+                                 struct bucket*        bucket,
+                                 mochi_plumber_pick_fn pick,
+                                 void*                 pick_arg,
+                                 const char**          out_nic)
+{
+    int         ret;
+    char        userdir[128];
+    char        tokenpath[256] = {0};
+    const char* job_id         = mochi_plumber_job_id();
+    int         fd;
+    int         nic_idx = -1;
+
+    if (pick) {
+        nic_idx = pick(pick_arg, "roundrobin", bucket->num_nics, bucket->nics);
+        if (nic_idx < 0 || nic_idx >= bucket->num_nics) return (-1);
+        *out_nic = bucket->nics[nic_idx];
+        return (0);
+    }
 
-    snprintf(tokenpath, 256, "/tmp/%s-mochi-plumber", getlogin());
+    mochi_plumber_user_dir(userdir, sizeof(userdir));
+    snprintf(tokenpath, 256, "%s", userdir);
     ret = mkdir(tokenpath, 0700);
     if (ret != 0 && errno != EEXIST) {
         perror("mkdir");
@@ -276,12 +1533,24 @@ static int select_nic_roundrobin(int            bucket_idx,
         return (-1);
     }
 
-    snprintf(tokenpath, 256, "/tmp/%s-mochi-plumber/%d", getlogin(),
-             bucket_idx);
+    /* each job starts from fresh counters */
+    if (job_id) {
+        snprintf(tokenpath, 256, "%s/job-%s", userdir, job_id);
+        ret = mkdir(tokenpath, 0700);
+        if (ret != 0 && errno != EEXIST) {
+            perror("mkdir");
+            fprintf(stderr, "Error: failed to create %s\n", tokenpath);
+            return (-1);
+        }
+    }
+
+    snprintf(tokenpath, 256, "%s%s%s/%d", userdir, job_id ? "/job-" : "",
+             job_id ? job_id : "", bucket_idx);
     fd = open(tokenpath, O_RDWR | O_CREAT | O_SYNC, 0600);
     if (fd < 0) {
         perror("open");
         fprintf(stderr, "Error: failed to open %s\n", tokenpath);
+        return (-1);
     }
 
     /* exlusive lock file */
@@ -296,6 +1565,7 @@ static int select_nic_roundrobin(int            bucket_idx,
         perror("pread");
         fprintf(stderr, "Error: failed to read %s\n", tokenpath);
         flock(fd, LOCK_UN);
+        close(fd);
         return (-1);
     }
     /* select next nic */
@@ -306,19 +1576,32 @@ static int select_nic_roundrobin(int            bucket_idx,
         perror("pwrite");
         fprintf(stderr, "Error: failed to write %s\n", tokenpath);
         flock(fd, LOCK_UN);
+        close(fd);
         return (-1);
     }
     flock(fd, LOCK_UN);
+    close(fd);
 
     *out_nic = bucket->nics[nic_idx];
     return (0);
 }
 
-static int
-select_nic_random(int bucket_idx, struct bucket* bucket, const char** out_nic)
+static int select_nic_random(int                   bucket_idx,
+                             struct bucket*        bucket,
+                             mochi_plumber_pick_fn pick,
+                             void*                 pick_arg,
+                             const char**          out_nic)
 {
     int nic_idx = -1;
 
+    /* seeding by pid below would give every client of a broker the same NIC */
+    if (pick) {
+        nic_idx = pick(pick_arg, "random", bucket->num_nics, bucket->nics);
+        if (nic_idx < 0 || nic_idx >= bucket->num_nics) return (-1);
+        *out_nic = bucket->nics[nic_idx];
+        return (0);
+    }
+
     /* we only need to worry about unique seeding within a single node, so
      * its sufficient to just use the pid
      */
@@ -332,102 +1615,211 @@ select_nic_random(int bucket_idx, struct bucket* bucket, const char** out_nic)
 /* static mapping based on what specific core the process is presently
  * runnign on.
  */
-static int select_nic_bycore(hwloc_topology_t* topology,
-                             int               bucket_idx,
-                             struct bucket*    bucket,
-                             const char**      out_nic)
+static int select_nic_bycore(hwloc_topology_t*    topology,
+                             int                  bucket_idx,
+                             struct bucket*       bucket,
+                             hwloc_const_cpuset_t last_cpu,
+                             const char**         out_nic)
 {
-    int            nic_idx = -1;
-    int            ret;
-    hwloc_cpuset_t last_cpu;
+    int nic_idx = -1;
 
-    last_cpu = hwloc_bitmap_alloc();
-    assert(last_cpu);
+    nic_idx = bucket_nic_index(topology, bucket, hwloc_bitmap_first(last_cpu));
 
-    ret = hwloc_get_last_cpu_location(*topology, last_cpu,
-                                      HWLOC_CPUBIND_THREAD);
-    if (ret < 0) {
-        hwloc_bitmap_free(last_cpu);
-        fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
-        return (-1);
-    }
-    nic_idx = hwloc_bitmap_first(last_cpu) % bucket->num_nics;
-    hwloc_bitmap_free(last_cpu);
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* Static mapping based on the set of cores the process is allowed to run
+ * on, using its first PU within the bucket (a binding that spans several
+ * buckets may start outside the chosen one).
+ */
+static int select_nic_byset(hwloc_topology_t*    topology,
+                            int                  bucket_idx,
+                            struct bucket*       bucket,
+                            hwloc_const_cpuset_t cpuset,
+                            const char**         out_nic)
+{
+    int nic_idx = -1;
+
+    hwloc_bitmap_and(cache.scratch, cpuset, bucket->cpuset);
+    if (hwloc_bitmap_iszero(cache.scratch))
+        hwloc_bitmap_copy(cache.scratch, cpuset);
+    nic_idx = bucket_nic_index(topology, bucket,
+                               hwloc_bitmap_first(cache.scratch));
 
     *out_nic = bucket->nics[nic_idx];
     return (0);
 }
 
-/* static mapping based on the set of cores the process is allowed to run on */
-static int select_nic_byset(hwloc_topology_t* topology,
-                            int               bucket_idx,
-                            struct bucket*    bucket,
-                            const char**      out_nic)
+/* Prefer a NIC whose interrupts are handled close to the PU that this
+ * process is executing on, but not on its own core, where they would
+ * compete with it.  Each interrupt vector scores -1 if it may land on the
+ * process's core, and otherwise by how deep the smallest topology object
+ * that covers both the PU and the vector's PUs is.  NICs are ranked by the
+ * average over their vectors, so that a multi-queue NIC that steers one
+ * vector to every core is judged by where most of its vectors go rather
+ * than by their union.  Ties (including NICs whose interrupt affinity is
+ * unknown) are broken with the bycore mapping.
+ */
+static int select_nic_irq(hwloc_topology_t*    topology,
+                          int                  bucket_idx,
+                          struct bucket*       bucket,
+                          hwloc_const_cpuset_t last_cpu,
+                          const char**         out_nic)
 {
-    int            nic_idx = -1;
-    int            ret;
-    hwloc_cpuset_t cpuset;
+    const struct nic_irqs* irqs;
+    hwloc_obj_t            pu;
+    hwloc_obj_t            core;
+    hwloc_obj_t            covering;
+    int                    preferred;
+    int                    nic_idx   = -1;
+    long                   best      = 0;
+    long                   best_over = 1;
+    long                   score;
+    long                   over;
+    int                    idx;
+    int                    i;
+    int                    v;
 
-    cpuset = hwloc_bitmap_alloc();
-    assert(cpuset);
+    preferred
+        = bucket_nic_index(topology, bucket, hwloc_bitmap_first(last_cpu));
 
-    ret = hwloc_get_cpubind(*topology, cpuset, HWLOC_CPUBIND_PROCESS);
-    if (ret < 0) {
-        hwloc_bitmap_free(cpuset);
-        fprintf(stderr, "hwloc_get_cpuset_location() failure.\n");
-        return (-1);
+    pu = hwloc_get_pu_obj_by_os_index(*topology, hwloc_bitmap_first(last_cpu));
+    if (!pu) {
+        *out_nic = bucket->nics[preferred];
+        return (0);
+    }
+    core = hwloc_get_ancestor_obj_by_type(*topology, HWLOC_OBJ_CORE, pu);
+    if (!core) core = pu;
+
+    /* visit NICs starting from the bycore choice so that it wins ties */
+    for (i = 0; i < bucket->num_nics; i++) {
+        idx   = (preferred + i) % bucket->num_nics;
+        irqs  = bucket->irqs[idx];
+        score = 0;
+        over  = irqs->num_vectors ? irqs->num_vectors : 1;
+        for (v = 0; v < irqs->num_vectors; v++) {
+            if (hwloc_bitmap_intersects(irqs->vectors[v], core->cpuset))
+                score -= 1;
+            else {
+                hwloc_bitmap_or(cache.scratch, irqs->vectors[v], last_cpu);
+                covering
+                    = hwloc_get_obj_covering_cpuset(*topology, cache.scratch);
+                if (covering) score += covering->depth + 1;
+            }
+        }
+        /* compare score / over with best / best_over */
+        if (nic_idx < 0 || score * best_over > best * over) {
+            best      = score;
+            best_over = over;
+            nic_idx   = idx;
+        }
     }
-    nic_idx = hwloc_bitmap_first(cpuset) % bucket->num_nics;
-    hwloc_bitmap_free(cpuset);
 
     *out_nic = bucket->nics[nic_idx];
     return (0);
 }
 
-static int count_packages(hwloc_topology_t* topology)
+/* Map a PU to a NIC within a bucket.  The physical cores of the bucket are
+ * ranked in topology order and split into num_nics contiguous blocks of
+ * (nearly) equal size.  This keeps the distribution even no matter how the
+ * OS numbers PUs, and hyperthreads of the same core always share a NIC.
+ */
+static int bucket_nic_index(hwloc_topology_t* topology,
+                            struct bucket*    bucket,
+                            int               pu_os_index)
 {
+    hwloc_obj_t pu;
+    hwloc_obj_t core;
     hwloc_obj_t obj = NULL;
-    hwloc_obj_t root;
-    int         package_count = 0;
+    int         ncores;
+    int         rank = 0;
+
+    pu = hwloc_get_pu_obj_by_os_index(*topology, pu_os_index);
+    if (!pu) return (pu_os_index % bucket->num_nics);
+
+    /* fall back to PU granularity if the topology has no Core objects */
+    core = hwloc_get_ancestor_obj_by_type(*topology, HWLOC_OBJ_CORE, pu);
+    if (!core) core = pu;
 
-    root = hwloc_get_root_obj(*topology);
-    do {
-        obj = hwloc_get_next_child(*topology, root, obj);
-        if (obj && obj->type == HWLOC_OBJ_PACKAGE) { package_count++; }
-    } while (obj);
+    ncores = hwloc_get_nbobjs_inside_cpuset_by_type(*topology, bucket->cpuset,
+                                                    core->type);
+    while ((obj = hwloc_get_next_obj_inside_cpuset_by_type(
+                *topology, bucket->cpuset, core->type, obj))
+           && obj != core)
+        rank++;
 
-    return (package_count);
+    /* the PU is outside of this bucket (e.g., the process is running on a
+     * core that has since been excluded from it); spread by PU instead
+     */
+    if (!obj || ncores < 1) return (pu_os_index % bucket->num_nics);
+
+    return ((rank * bucket->num_nics) / ncores);
 }
 
-static int setup_buckets(hwloc_topology_t* topology,
-                         const char*       bucket_policy,
-                         int*              nbuckets,
-                         struct bucket**   buckets)
+/* Decide whether a NUMA node gets a bucket of its own under the numa and
+ * measured policies.  Nodes without CPUs, nodes that share their CPUs with
+ * a node that comes before them (e.g., HBM next to DRAM), and nodes whose
+ * CPUs are a superset of another node's (e.g., CXL memory attached at the
+ * package level) are additional memory tiers rather than distinct
+ * localities.
+ */
+static int numa_is_bucket(hwloc_topology_t* topology, hwloc_obj_t numa)
 {
-    hwloc_const_bitmap_t nset_all;
-    struct fi_info*      info;
-    struct fi_info*      hints;
-    struct fi_info*      cur;
-    int                  ret;
-    hwloc_obj_t          pci_dev;
-    int                  bucket_idx = 0;
-    hwloc_obj_t          non_io_ancestor;
-    hwloc_obj_t          package_ancestor;
-    int                  i;
+    hwloc_obj_t other = NULL;
+
+    if (hwloc_bitmap_iszero(numa->cpuset)) return (0);
+
+    while ((other = hwloc_get_next_obj_by_type(*topology, HWLOC_OBJ_NUMANODE,
+                                               other))) {
+        if (other == numa || hwloc_bitmap_iszero(other->cpuset)) continue;
+        if (hwloc_bitmap_isequal(other->cpuset, numa->cpuset)) {
+            if (other->logical_index < numa->logical_index) return (0);
+        } else if (hwloc_bitmap_isincluded(other->cpuset, numa->cpuset))
+            return (0);
+    }
+
+    return (1);
+}
+
+/* List the objects that define each bucket for a bucket policy, in logical
+ * order, so that bucket indices are dense regardless of how the OS numbers
+ * NUMA nodes and packages.  Objects with no PUs that the process may use
+ * (e.g., outside of its cgroup) do not get buckets.  *bucket_objs is NULL
+ * for the "all" policy and must otherwise be freed by the caller.  *depth
+ * is set for policies that name a generic topology level and is -1
+ * otherwise.
+ */
+static int get_bucket_objs(hwloc_topology_t* topology,
+                           const char*       bucket_policy,
+                           int*              depth,
+                           int*              nbuckets,
+                           hwloc_obj_t**     bucket_objs)
+{
+    hwloc_obj_t obj = NULL;
+    int         max;
+    int         i;
+
+    *depth       = -1;
+    *nbuckets    = 0;
+    *bucket_objs = NULL;
 
-    /* figure out how many buckets there will be */
     if (strcmp(bucket_policy, "all") == 0) {
         /* just one big bucket */
         *nbuckets = 1;
-    } else if (strcmp(bucket_policy, "numa") == 0) {
-        /* we need to query number of numa domains and make a bucket for
-         * each
-         */
-        nset_all  = hwloc_topology_get_complete_nodeset(*topology);
-        *nbuckets = hwloc_bitmap_weight(nset_all);
+        return (0);
+    } else if (strcmp(bucket_policy, "numa") == 0
+               || strcmp(bucket_policy, "measured") == 0) {
+        /* a bucket for each NUMA node that is a distinct locality */
+        max = hwloc_get_nbobjs_by_type(*topology, HWLOC_OBJ_NUMANODE);
     } else if (strcmp(bucket_policy, "package") == 0) {
-        /* query number of packages and make a bucket for each */
-        *nbuckets = count_packages(topology);
+        /* a bucket for each package */
+        max = hwloc_get_nbobjs_by_type(*topology, HWLOC_OBJ_PACKAGE);
+    } else if (bucket_policy_depth(topology, bucket_policy, depth) == 0) {
+        /* a bucket for each object at the requested level of the topology
+         * (L3 cache, die, group, etc.)
+         */
+        max = hwloc_get_nbobjs_by_depth(*topology, *depth);
     } else {
         fprintf(stderr,
                 "mochi_plumber_resolve_nic: unknown bucket policy \"%s\"\n",
@@ -435,97 +1827,382 @@ static int setup_buckets(hwloc_topology_t* topology,
         return (-1);
     }
 
-    *buckets = calloc(*nbuckets, sizeof(**buckets));
-    if (!*buckets) { return (-1); }
+    if (max < 1) {
+        fprintf(stderr,
+                "mochi_plumber_resolve_nic: no objects for bucket policy "
+                "\"%s\"\n",
+                bucket_policy);
+        return (-1);
+    }
+    *bucket_objs = malloc(max * sizeof(**bucket_objs));
+    if (!*bucket_objs) return (-1);
+
+    if (*depth >= 0) {
+        for (i = 0; i < max; i++) {
+            obj = hwloc_get_obj_by_depth(*topology, *depth, i);
+            if (!hwloc_bitmap_iszero(obj->cpuset))
+                (*bucket_objs)[(*nbuckets)++] = obj;
+        }
+    } else if (strcmp(bucket_policy, "package") == 0) {
+        while ((obj = hwloc_get_next_obj_by_type(*topology, HWLOC_OBJ_PACKAGE,
+                                                 obj))) {
+            if (!hwloc_bitmap_iszero(obj->cpuset))
+                (*bucket_objs)[(*nbuckets)++] = obj;
+        }
+    } else {
+        while ((obj = hwloc_get_next_obj_by_type(*topology,
+                                                 HWLOC_OBJ_NUMANODE, obj))) {
+            if (numa_is_bucket(topology, obj))
+                (*bucket_objs)[(*nbuckets)++] = obj;
+        }
+    }
 
-    /* query libfabric for interfaces */
-    hints = fi_allocinfo();
-    assert(hints);
-    /* These are required as input if we want to filter the results; they
-     * indicate functionality that the caller is prepared to provide.  This
-     * is just a query, so we want wildcard options except that we must disable
-     * deprecated memory registration modes.
+    return (0);
+}
+
+/* Translate a bucket policy into the depth of the hwloc objects that will
+ * define the buckets.  The policy may be any hwloc object type name that is
+ * present in the topology (e.g., "l3", "die", "group1", "core") or an
+ * explicit depth in the form "depth:<n>".  Returns -1 if the policy does
+ * not name a usable (normal, non-memory, non-I/O) level of the topology.
+ */
+static int bucket_policy_depth(hwloc_topology_t* topology,
+                               const char*       bucket_policy,
+                               int*              depth)
+{
+    hwloc_obj_type_t type;
+    char*            end;
+
+    if (strncmp(bucket_policy, "depth:", strlen("depth:")) == 0) {
+        *depth = strtol(bucket_policy + strlen("depth:"), &end, 10);
+        if (end == bucket_policy + strlen("depth:") || *end != '\0')
+            return (-1);
+    } else {
+        if (hwloc_type_sscanf_as_depth(bucket_policy, &type, *topology, depth)
+            < 0)
+            return (-1);
+    }
+
+    /* negative depths are either unknown, ambiguous (e.g. "group" when
+     * there are several levels of groups), or virtual depths for memory and
+     * I/O objects, none of which have a cpuset that we can bucket by
      */
-    hints->mode                 = ~0;
-    hints->domain_attr->mode    = ~0;
-    hints->domain_attr->mr_mode = ~3;
-    /* only supporting cxi for now */
-    hints->fabric_attr->prov_name = strdup("cxi");
-    hints->ep_attr->protocol      = FI_PROTO_CXI;
-    ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION), NULL, NULL,
-                     0, hints, &info);
+    if (*depth < 0 || *depth >= hwloc_topology_get_depth(*topology))
+        return (-1);
+
+    return (0);
+}
+
+static int setup_buckets(hwloc_topology_t*       topology,
+                         const struct transport* transport,
+                         const char*             bucket_policy,
+                         int*                    nbuckets,
+                         struct bucket**         buckets,
+                         int*                    num_irqs,
+                         struct nic_irqs**       nic_irqs)
+{
+    hwloc_obj_t*            bucket_objs = NULL;
+    struct fi_info*         info        = NULL;
+    struct fi_info*         cur;
+    int                     ret;
+    hwloc_obj_t             pci_dev;
+    hwloc_obj_t             ancestor;
+    hwloc_bitmap_t*         nic_localities = NULL;
+    char**                  nic_names      = NULL;
+    hwloc_bitmap_t*         nic_buckets    = NULL;
+    hwloc_const_cpuset_t*   scopes         = NULL;
+    int                     num_nics       = 0;
+    int                     num_entries    = 0;
+    size_t                  name_bytes     = 0;
+    char**                  next_entry;
+    const struct nic_irqs** next_irq;
+    char*                   next_name;
+    int                     depth;
+    int                     i;
+    int                     j;
+
+    /* figure out how many buckets there will be */
+    *num_irqs = 0;
+    *nic_irqs = NULL;
+    if (strcmp(bucket_policy, "measured") == 0 && measured_failed())
+        return (-1);
+    ret = get_bucket_objs(topology, bucket_policy, &depth, nbuckets,
+                          &bucket_objs);
+    if (ret < 0) return (-1);
+
+    /* query libfabric for interfaces */
+    ret = transport_getinfo(transport, &info);
     if (ret != 0) {
         fprintf(stderr, "fi_getinfo: %d (%s)\n", ret, fi_strerror(-ret));
-        fi_freeinfo(hints);
-        free(*buckets);
-        return (ret);
+        info = NULL;
+        goto out;
+    }
+
+    /* count the interfaces that report PCI bus information */
+    for (cur = info; cur; cur = cur->next) {
+        if (is_local_nic(info, cur)) num_nics++;
+    }
+    nic_localities = calloc(num_nics, sizeof(*nic_localities));
+    nic_names      = calloc(num_nics, sizeof(*nic_names));
+    nic_buckets    = calloc(num_nics, sizeof(*nic_buckets));
+    scopes         = calloc(*nbuckets, sizeof(*scopes));
+    if ((num_nics && (!nic_localities || !nic_names || !nic_buckets))
+        || (*nbuckets && !scopes)) {
+        ret = -1;
+        goto out;
+    }
+
+    *nic_irqs = calloc(num_nics, sizeof(**nic_irqs));
+    if (num_nics && !*nic_irqs) {
+        ret = -1;
+        goto out;
+    }
+    for (j = 0; j < num_nics; j++) {
+        nic_localities[j] = hwloc_bitmap_alloc();
+        nic_buckets[j]    = hwloc_bitmap_alloc();
+        if (!nic_localities[j] || !nic_buckets[j]) {
+            ret = -1;
+            goto out;
+        }
     }
-    fi_freeinfo(hints);
 
-    /* iterate through interfaces and assign to buckets */
+    /* iterate through interfaces and find the bucket each belongs to */
+    i = 0;
     for (cur = info; cur; cur = cur->next) {
-        if (cur->nic && cur->nic->bus_attr
-            && cur->nic->bus_attr->bus_type == FI_BUS_PCI) {
+        if (is_local_nic(info, cur)) {
 
             /* look for this device in hwloc topology */
             struct fi_pci_attr pci = cur->nic->bus_attr->attr.pci;
             pci_dev = hwloc_get_pcidev_by_busid(*topology, pci.domain_id,
                                                 pci.bus_id, pci.device_id,
                                                 pci.function_id);
-            if (!pci_dev) {
-                fprintf(stderr, "Error: can't find %s in hwloc topology.\n",
-                        cur->domain_attr->name);
-                fi_freeinfo(info);
-                for (i = 0; i < *nbuckets; i++) {
-                    if ((*buckets)[i].nics) free((*buckets)[i].nics);
-                }
-                free(*buckets);
-                return (-1);
+            if (pci_dev)
+                hwloc_bitmap_copy(
+                    nic_localities[i],
+                    hwloc_get_non_io_ancestor_obj(*topology, pci_dev)->cpuset);
+            /* hwloc doesn't see devices when /sys is partially masked (e.g.,
+             * in some containers), so ask /sys directly, and failing that
+             * treat the NIC as local to every PU
+             */
+            else if (mochi_plumber_pci_cpuset(*topology, pci.domain_id,
+                                              pci.bus_id, pci.device_id,
+                                              pci.function_id,
+                                              nic_localities[i])
+                     < 0)
+                hwloc_bitmap_copy(nic_localities[i],
+                                  hwloc_topology_get_allowed_cpuset(*topology));
+            nic_names[i] = cur->domain_attr->name;
+            name_bytes += strlen(cur->domain_attr->name) + 1;
+            /* unknown (e.g., without access to /proc) is left empty */
+            (*nic_irqs)[i].num_vectors = mochi_plumber_irq_vectors(
+                pci.domain_id, pci.bus_id, pci.device_id, pci.function_id,
+                &(*nic_irqs)[i].vectors);
+            if ((*nic_irqs)[i].num_vectors < 0)
+                (*nic_irqs)[i].num_vectors = 0;
+            /* add to the global bucket; other policies are assigned below
+             * once all NICs are known
+             */
+            if (*nbuckets == 1) hwloc_bitmap_only(nic_buckets[i], 0);
+            i++;
+        }
+    }
+
+    /* A NIC is placed in every bucket whose object shares PUs with the
+     * NIC's locality.  That covers both NICs attached below the bucket
+     * level (e.g., a NIC local to one L3 within a package bucket) and above
+     * it (e.g., a package-local NIC serves every NUMA domain in that
+     * package under sub-NUMA clustering).  For generic topology levels,
+     * buckets that no NIC is local to draw from the nearest enclosing
+     * object that does have local NICs.
+     */
+    for (i = 0; bucket_objs && i < *nbuckets; i++) {
+        if (depth < 0) {
+            scopes[i] = bucket_objs[i]->cpuset;
+            continue;
+        }
+        for (ancestor = bucket_objs[i]; ancestor && !scopes[i];
+             ancestor = ancestor->parent) {
+            for (j = 0; j < num_nics; j++) {
+                if (hwloc_bitmap_intersects(ancestor->cpuset,
+                                            nic_localities[j]))
+                    scopes[i] = ancestor->cpuset;
             }
-            if (*nbuckets == 1) {
-                /* add to the global bucket */
-                bucket_idx = 0;
-            } else if (strcmp(bucket_policy, "numa") == 0) {
-                /* figure out what numa domain this maps to and put it in
-                 * that bucket
-                 */
-                non_io_ancestor
-                    = hwloc_get_non_io_ancestor_obj(*topology, pci_dev);
-                bucket_idx = hwloc_bitmap_first(non_io_ancestor->nodeset);
-            } else if (strcmp(bucket_policy, "package") == 0) {
-                /* figure out what package this maps to and put it in that
-                 * bucket
-                 */
-                package_ancestor = hwloc_get_ancestor_obj_by_type(
-                    *topology, HWLOC_OBJ_PACKAGE, pci_dev);
-                bucket_idx = package_ancestor->os_index;
+        }
+    }
+
+    /* the measured policy places NICs according to an affinity table
+     * recorded by mochi_plumber_probe() rather than the topology
+     */
+    if (strcmp(bucket_policy, "measured") == 0) {
+        ret = assign_measured_buckets(*nbuckets, bucket_objs, num_nics,
+                                      nic_names, nic_buckets);
+        if (ret < 0) goto out;
+    } else {
+        for (i = 0; bucket_objs && i < *nbuckets; i++) {
+            for (j = 0; j < num_nics; j++) {
+                if (scopes[i]
+                    && hwloc_bitmap_intersects(scopes[i], nic_localities[j]))
+                    hwloc_bitmap_set(nic_buckets[j], i);
             }
+        }
+    }
+
+    /* size the bucket table so that it can be built in one allocation */
+    for (j = 0; j < num_nics; j++)
+        num_entries += hwloc_bitmap_weight(nic_buckets[j]);
+    *buckets = calloc(1, *nbuckets * sizeof(**buckets)
+                             + num_entries * sizeof(*(*buckets)->nics)
+                             + num_entries * sizeof(*(*buckets)->irqs)
+                             + name_bytes);
+    if (!*buckets) {
+        ret = -1;
+        goto out;
+    }
+    next_entry = (char**)(*buckets + *nbuckets);
+    next_irq   = (const struct nic_irqs**)(next_entry + num_entries);
+    next_name  = (char*)(next_irq + num_entries);
 
-            (*buckets)[bucket_idx].num_nics++;
-            (*buckets)[bucket_idx].nics
-                = realloc((*buckets)[bucket_idx].nics,
-                          (*buckets)[bucket_idx].num_nics
-                              * sizeof(*(*buckets)[bucket_idx].nics));
-            assert((*buckets)[bucket_idx].nics);
-            (*buckets)[bucket_idx].nics[(*buckets)[bucket_idx].num_nics - 1]
-                = strdup(cur->domain_attr->name);
-            assert((*buckets)[bucket_idx]
-                       .nics[(*buckets)[bucket_idx].num_nics - 1]);
+    /* copy NIC names into the table, then point each bucket at them */
+    for (j = 0; j < num_nics; j++) {
+        strcpy(next_name, nic_names[j]);
+        nic_names[j] = next_name;
+        next_name += strlen(next_name) + 1;
+    }
+    for (i = 0; i < *nbuckets; i++) {
+        (*buckets)[i].nics = next_entry;
+        (*buckets)[i].irqs = next_irq;
+        for (j = 0; j < num_nics; j++) {
+            if (!hwloc_bitmap_isset(nic_buckets[j], i)) continue;
+            (*buckets)[i].irqs[(*buckets)[i].num_nics]   = &(*nic_irqs)[j];
+            (*buckets)[i].nics[(*buckets)[i].num_nics++] = nic_names[j];
         }
+        next_entry += (*buckets)[i].num_nics;
+        next_irq += (*buckets)[i].num_nics;
+    }
+
+    /* record which PUs each bucket serves */
+    for (i = 0; i < *nbuckets; i++)
+        (*buckets)[i].cpuset
+            = bucket_objs ? bucket_objs[i]->cpuset
+                          : hwloc_topology_get_allowed_cpuset(*topology);
+    *num_irqs = num_nics;
+    ret       = 0;
+
+out:
+    for (j = 0; nic_buckets && j < num_nics; j++)
+        hwloc_bitmap_free(nic_buckets[j]);
+    for (j = 0; nic_localities && j < num_nics; j++)
+        hwloc_bitmap_free(nic_localities[j]);
+    if (ret != 0 && *nic_irqs) {
+        for (j = 0; j < num_nics; j++)
+            mochi_plumber_irq_vectors_free((*nic_irqs)[j].vectors,
+                                           (*nic_irqs)[j].num_vectors);
+        free(*nic_irqs);
+        *nic_irqs = NULL;
     }
-    fi_freeinfo(info);
+    free(nic_localities);
+    free(nic_names);
+    free(nic_buckets);
+    free(scopes);
+    free(bucket_objs);
+    if (info) fi_freeinfo(info);
+
+    return (ret);
+}
+
+/* Whether the affinity table is known to be unusable: reading it failed
+ * before and it hasn't been modified (or created) since.  Records the
+ * table's current modification time for assign_measured_buckets().
+ */
+static int measured_failed(void)
+{
+    char        path[256];
+    struct stat st;
 
+    mochi_plumber_affinity_path(path, sizeof(path));
+    if (stat(path, &st) < 0) memset(&st, 0, sizeof(st));
+    if (cache.measured_failed
+        && st.st_mtim.tv_sec == cache.measured_mtime.tv_sec
+        && st.st_mtim.tv_nsec == cache.measured_mtime.tv_nsec)
+        return (1);
+
+    cache.measured_failed = 0;
+    cache.measured_mtime  = st.st_mtim;
     return (0);
 }
 
-static void release_buckets(int nbuckets, struct bucket* buckets)
+/* Place each NIC in the NUMA buckets from which its measured latency is
+ * within MEASURED_TOLERANCE of the best NIC measured from that domain.  NICs
+ * that are missing from the affinity table, and measurements from NUMA
+ * nodes that do not define a bucket, are ignored.
+ */
+static int assign_measured_buckets(int             nbuckets,
+                                   hwloc_obj_t*    bucket_objs,
+                                   int             num_nics,
+                                   char**          nic_names,
+                                   hwloc_bitmap_t* nic_buckets)
 {
-    int i;
+    char                           path[256];
+    struct mochi_plumber_affinity* entries;
+    int                            num_entries;
+    double*                        best;
+    int*                           bucket;
+    int                            ret;
+    int                            b;
+    int                            i;
+    int                            j;
 
-    for (i = 0; i < nbuckets; i++) {
-        if (buckets[i].nics) free(buckets[i].nics);
+    mochi_plumber_affinity_path(path, sizeof(path));
+    ret = mochi_plumber_affinity_read(path, &num_entries, &entries);
+    if (ret < 0) {
+        fprintf(stderr, "Error: unable to read NIC affinity table %s.\n",
+                path);
+        cache.measured_failed = 1;
+        return (-1);
+    }
+
+    best   = malloc(nbuckets * sizeof(*best));
+    bucket = malloc(num_entries * sizeof(*bucket));
+    if (!best || (num_entries && !bucket)) {
+        free(best);
+        free(bucket);
+        free(entries);
+        return (-1);
+    }
+    for (i = 0; i < nbuckets; i++) best[i] = -1;
+
+    /* the table records OS NUMA indices; translate them to buckets */
+    for (i = 0; i < num_entries; i++) {
+        bucket[i] = -1;
+        for (b = 0; b < nbuckets; b++) {
+            if ((int)bucket_objs[b]->os_index == entries[i].numa)
+                bucket[i] = b;
+        }
     }
-    free(buckets);
 
-    return;
+    /* find the lowest latency from each domain to any NIC we know about */
+    for (i = 0; i < num_entries; i++) {
+        if (bucket[i] < 0) continue;
+        for (j = 0; j < num_nics; j++) {
+            if (strcmp(entries[i].nic, nic_names[j]) != 0) continue;
+            if (best[bucket[i]] < 0 || entries[i].latency < best[bucket[i]])
+                best[bucket[i]] = entries[i].latency;
+        }
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        if (bucket[i] < 0) continue;
+        for (j = 0; j < num_nics; j++) {
+            if (strcmp(entries[i].nic, nic_names[j]) != 0) continue;
+            if (entries[i].latency
+                <= best[bucket[i]] * (1.0 + MEASURED_TOLERANCE))
+                hwloc_bitmap_set(nic_buckets[j], bucket[i]);
+        }
+    }
+
+    free(bucket);
+    free(best);
+    free(entries);
+
+    return (0);
 }
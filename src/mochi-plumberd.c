@@ -0,0 +1,473 @@
+/**
+ * @file mochi-plumberd.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <hwloc.h>
+
+#include "mochi-plumber-internal.h"
+
+/* seconds a client may leave a response unread before it is dropped */
+#define SEND_TIMEOUT 1
+
+/* Node-local broker.  It owns the topology and bucket tables on behalf of
+ * every process on the node and keeps a ledger of which NIC each connected
+ * process was assigned.  The roundrobin policy picks the least loaded NIC
+ * in the bucket according to the ledger, and assignments are released when
+ * a process disconnects (including when it exits or crashes).
+ */
+
+struct options {
+    char socket_path[108];
+};
+
+struct ledger_entry {
+    char nic[MOCHI_PLUMBER_NIC_MAX];
+    int  count;
+};
+
+/* the NIC a client was last given for a transport */
+struct assignment {
+    char transport[64];
+    int  entry; /* index into the ledger */
+};
+
+struct client {
+    int                fd;
+    char               buf[4096];
+    int                len;
+    int                num_assigned;
+    struct assignment* assigned; /* at most one per transport */
+};
+
+struct broker {
+    int                  listen_fd;
+    int                  num_clients;
+    struct client*       clients;
+    int                  num_entries;
+    struct ledger_entry* ledger;
+    unsigned int         rr;   /* rotates roundrobin tie breaking */
+    unsigned int         seed; /* for the random policy */
+    hwloc_bitmap_t       last_cpu;
+    hwloc_bitmap_t       cpuset;
+    hwloc_bitmap_t       membind;
+};
+
+static volatile sig_atomic_t done = 0;
+
+static int  parse_args(int argc, char** argv, struct options* opts);
+static void usage(void);
+static void handle_signal(int sig);
+static int  open_socket(const char* path);
+static void accept_client(struct broker* broker);
+static int  read_client(struct broker* broker, struct client* client);
+static int  handle_request(struct broker* broker,
+                           struct client* client,
+                           char*          line);
+static int  send_response(struct client* client, const char* response);
+static void drop_client(struct broker* broker, int idx);
+static int  ledger_index(struct broker* broker, const char* nic);
+static int  pick_nic(void*       arg,
+                     const char* nic_policy,
+                     int         num_nics,
+                     char**      nics);
+
+int main(int argc, char** argv)
+{
+    struct options opts;
+    struct broker  broker;
+    struct pollfd* fds = NULL;
+    int            nfds;
+    int            ret;
+    int            i;
+
+    ret = parse_args(argc, argv, &opts);
+    if (ret < 0) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&broker, 0, sizeof(broker));
+    broker.seed     = time(NULL) ^ getpid();
+    broker.last_cpu = hwloc_bitmap_alloc();
+    broker.cpuset   = hwloc_bitmap_alloc();
+    broker.membind  = hwloc_bitmap_alloc();
+    assert(broker.last_cpu && broker.cpuset && broker.membind);
+
+    broker.listen_fd = open_socket(opts.socket_path);
+    if (broker.listen_fd < 0) {
+        fprintf(stderr, "Error: unable to listen on %s.\n", opts.socket_path);
+        return (-1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    while (!done) {
+        nfds = broker.num_clients + 1;
+        fds  = realloc(fds, nfds * sizeof(*fds));
+        assert(fds);
+        fds[0].fd     = broker.listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < broker.num_clients; i++) {
+            fds[i + 1].fd     = broker.clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        ret = poll(fds, nfds, -1);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        /* walk backwards so that dropping a client doesn't shift the ones
+         * we have yet to look at
+         */
+        for (i = nfds - 1; i > 0; i--) {
+            if (!fds[i].revents) continue;
+            if (read_client(&broker, &broker.clients[i - 1]) < 0)
+                drop_client(&broker, i - 1);
+        }
+        if (fds[0].revents & POLLIN) accept_client(&broker);
+    }
+
+    close(broker.listen_fd);
+    unlink(opts.socket_path);
+    while (broker.num_clients) drop_client(&broker, 0);
+    free(fds);
+    free(broker.clients);
+    free(broker.ledger);
+    hwloc_bitmap_free(broker.last_cpu);
+    hwloc_bitmap_free(broker.cpuset);
+    hwloc_bitmap_free(broker.membind);
+
+    return (0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mochi-plumberd [-s <socket_path>]\n");
+    return;
+}
+
+static int parse_args(int argc, char** argv, struct options* opts)
+{
+    int opt;
+    int ret;
+
+    memset(opts, 0, sizeof(*opts));
+    mochi_plumber_broker_path(opts->socket_path, sizeof(opts->socket_path));
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            ret = snprintf(opts->socket_path, sizeof(opts->socket_path), "%s",
+                           optarg);
+            if (ret >= (int)sizeof(opts->socket_path)) return (-1);
+            break;
+        default:
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    done = 1;
+}
+
+static int open_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    char               dir[sizeof(addr.sun_path)];
+    char*              slash;
+    int                fd;
+
+    /* the default location shares a private directory with the roundrobin
+     * token files
+     */
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            return (-1);
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return (-1);
+    }
+
+    /* remove a socket left behind by a broker that did not exit cleanly */
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return (-1);
+    }
+    if (listen(fd, 128) < 0) {
+        perror("listen");
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+static void accept_client(struct broker* broker)
+{
+    struct client* clients;
+    struct timeval timeout = {.tv_sec = SEND_TIMEOUT};
+    int            fd;
+
+    fd = accept4(broker->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    /* a client that stops reading must not stall every other client */
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))
+        < 0) {
+        perror("setsockopt");
+        close(fd);
+        return;
+    }
+
+    clients = realloc(broker->clients,
+                      (broker->num_clients + 1) * sizeof(*broker->clients));
+    if (!clients) {
+        close(fd);
+        return;
+    }
+    broker->clients = clients;
+    memset(&broker->clients[broker->num_clients], 0,
+           sizeof(*broker->clients));
+    broker->clients[broker->num_clients].fd = fd;
+    broker->num_clients++;
+}
+
+/* returns -1 if the client has disconnected or misbehaved */
+static int read_client(struct broker* broker, struct client* client)
+{
+    ssize_t ret;
+    char*   newline;
+    int     consumed;
+
+    ret = read(client->fd, client->buf + client->len,
+               sizeof(client->buf) - 1 - client->len);
+    if (ret <= 0) return (-1);
+    client->len += ret;
+    client->buf[client->len] = '\0';
+
+    /* handle every complete request line in the buffer */
+    consumed = 0;
+    while ((newline = strchr(client->buf + consumed, '\n'))) {
+        *newline = '\0';
+        if (handle_request(broker, client, client->buf + consumed) < 0)
+            return (-1);
+        consumed = newline - client->buf + 1;
+    }
+    memmove(client->buf, client->buf + consumed, client->len - consumed);
+    client->len -= consumed;
+
+    /* a request that doesn't fit in the buffer is not valid */
+    if (client->len == sizeof(client->buf) - 1) return (-1);
+
+    return (0);
+}
+
+/* returns -1 if the response could not be sent */
+static int handle_request(struct broker* broker,
+                          struct client* client,
+                          char*          line)
+{
+    char               transport[64];
+    char               bucket_policy[64];
+    char               nic_policy[64];
+    char               cpus[4096];
+    char               mems[256];
+    char               nic[MOCHI_PLUMBER_NIC_MAX];
+    char               response[MOCHI_PLUMBER_NIC_MAX + 16];
+    struct assignment* assigned;
+    int                cpu;
+    int                slot;
+    int                idx;
+    int                ret;
+    int                i;
+
+    if (strcmp(line, "ledger") == 0) {
+        /* report current assignments, terminated by a lone "." */
+        for (i = 0; i < broker->num_entries; i++) {
+            snprintf(response, sizeof(response), "%s %d\n",
+                     broker->ledger[i].nic, broker->ledger[i].count);
+            if (send_response(client, response) < 0) return (-1);
+        }
+        return (send_response(client, ".\n"));
+    }
+
+    /* the memory binding is only sent if the process has one */
+    ret = sscanf(line, "resolve %63s %63s %63s %d %4095s %255s", transport,
+                 bucket_policy, nic_policy, &cpu, cpus, mems);
+    if (ret < 5 || cpu < 0
+        || hwloc_bitmap_list_sscanf(broker->cpuset, cpus) < 0
+        || (ret == 6 && hwloc_bitmap_list_sscanf(broker->membind, mems) < 0))
+        return (send_response(client, "error\n"));
+    hwloc_bitmap_only(broker->last_cpu, cpu);
+
+    /* A client that resolves again for a transport (e.g., with its memo
+     * disabled) replaces its earlier assignment rather than adding to it,
+     * so that assignment doesn't count against it while picking.
+     */
+    for (slot = 0; slot < client->num_assigned; slot++) {
+        if (strcmp(client->assigned[slot].transport, transport) == 0) break;
+    }
+    if (slot < client->num_assigned)
+        broker->ledger[client->assigned[slot].entry].count--;
+
+    ret = mochi_plumber_select_nic_at(transport, bucket_policy, nic_policy,
+                                      broker->last_cpu, broker->cpuset,
+                                      ret == 6 ? broker->membind : NULL,
+                                      pick_nic, broker, nic, sizeof(nic));
+    if (ret < 0) {
+        if (slot < client->num_assigned)
+            broker->ledger[client->assigned[slot].entry].count++;
+        return (send_response(client, "error\n"));
+    }
+
+    /* record the assignment so that it can be released on disconnect */
+    idx = strlen(nic) ? ledger_index(broker, nic) : -1;
+    if (idx >= 0 && slot == client->num_assigned) {
+        assigned = realloc(client->assigned, (slot + 1) * sizeof(*assigned));
+        if (assigned) {
+            client->assigned = assigned;
+            snprintf(assigned[slot].transport,
+                     sizeof(assigned[slot].transport), "%s", transport);
+            client->num_assigned++;
+        } else
+            idx = -1;
+    }
+    if (slot < client->num_assigned) {
+        if (idx >= 0) {
+            client->assigned[slot].entry = idx;
+            broker->ledger[idx].count++;
+        } else
+            client->assigned[slot]
+                = client->assigned[--client->num_assigned];
+    }
+
+    snprintf(response, sizeof(response), "ok%s%s\n", strlen(nic) ? " " : "",
+             nic);
+    return (send_response(client, response));
+}
+
+/* Send a complete response line.  Clients are expected to read promptly;
+ * one whose socket stays full for SEND_TIMEOUT seconds is treated as gone.
+ */
+static int send_response(struct client* client, const char* response)
+{
+    size_t  len = strlen(response);
+    ssize_t ret;
+
+    ret = send(client->fd, response, len, MSG_NOSIGNAL);
+    if (ret < 0 || (size_t)ret != len) return (-1);
+
+    return (0);
+}
+
+static void drop_client(struct broker* broker, int idx)
+{
+    struct client* client = &broker->clients[idx];
+    int            i;
+
+    for (i = 0; i < client->num_assigned; i++)
+        broker->ledger[client->assigned[i].entry].count--;
+    free(client->assigned);
+    close(client->fd);
+
+    broker->clients[idx] = broker->clients[broker->num_clients - 1];
+    broker->num_clients--;
+}
+
+/* find (or add) the ledger entry for a NIC */
+static int ledger_index(struct broker* broker, const char* nic)
+{
+    struct ledger_entry* ledger;
+    int                  i;
+
+    for (i = 0; i < broker->num_entries; i++) {
+        if (strcmp(broker->ledger[i].nic, nic) == 0) return (i);
+    }
+
+    ledger = realloc(broker->ledger,
+                     (broker->num_entries + 1) * sizeof(*broker->ledger));
+    if (!ledger) return (-1);
+    broker->ledger = ledger;
+    snprintf(broker->ledger[i].nic, sizeof(broker->ledger[i].nic), "%s", nic);
+    broker->ledger[i].count = 0;
+    broker->num_entries++;
+
+    return (i);
+}
+
+/* Roundrobin picks the NIC in the bucket with the fewest live assignments
+ * according to the ledger, rotating the starting point to break ties.
+ * Random draws from a generator owned by the broker, since clients can't be
+ * told apart by the broker's pid.
+ */
+static int pick_nic(void*       arg,
+                    const char* nic_policy,
+                    int         num_nics,
+                    char**      nics)
+{
+    struct broker* broker = arg;
+    int            best   = -1;
+    int            best_count;
+    int            entry;
+    int            idx;
+    int            i;
+
+    if (strcmp(nic_policy, "random") == 0)
+        return (rand_r(&broker->seed) % num_nics);
+
+    for (i = 0; i < num_nics; i++) {
+        idx   = (broker->rr + i) % num_nics;
+        entry = ledger_index(broker, nics[idx]);
+        if (entry < 0) return (-1);
+        if (best < 0 || broker->ledger[entry].count < best_count) {
+            best       = idx;
+            best_count = broker->ledger[entry].count;
+        }
+    }
+    broker->rr++;
+
+    return (best);
+}